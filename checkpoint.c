@@ -5,20 +5,305 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/file.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
 
 #include <elf.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "sizes.h"
 #include "cpu.h"
 #include "internals.h"
-
-#if !defined(CONFIG_USER_ONLY)
+#include "lz.h"
+#if defined(CONFIG_USER_ONLY)
+#include "user.h"
+#endif
 
 #define __4KB 0x1000
 #define PAGE_SIZE __4KB
 #define PAGE_MASK 0XFFFUL
 
+static void loongarch_cpu_dump_state(CPULoongArchState *env, FILE *f);
+static void loongarch_cpu_restore_state(CPULoongArchState *env, FILE *f);
+
+static inline FILE* fopen_nofail(const char *__restrict __filename, const char *__restrict __modes) {
+    FILE* f = fopen(__filename, __modes);
+    if (!f) {
+        perror(__filename);
+        abort();
+    }
+    return f;
+}
+
+/*
+ * Page kernels, the zero check, xor sum and copy of a page in one pass over
+ * it. The widest vector unit of the host is picked at startup.
+ */
+static bool page_scan_generic(const void* page, uint64_t* xs) {
+    const uint64_t* p = page;
+    uint64_t x = 0, o = 0;
+    for (int i = 0; i < __4KB / 8; i++) {
+        x ^= p[i];
+        o |= p[i];
+    }
+    *xs ^= x;
+    return o != 0;
+}
+
+static uint64_t page_copy_generic(void* dst, const void* src) {
+    const uint64_t* s = src;
+    uint64_t* d = dst;
+    uint64_t x = 0;
+    for (int i = 0; i < __4KB / 8; i++) {
+        x ^= s[i];
+        d[i] = s[i];
+    }
+    return x;
+}
+
+#if defined(__x86_64__)
+static bool page_scan_sse2(const void* page, uint64_t* xs) {
+    const __m128i* p = page;
+    __m128i x0 = _mm_setzero_si128(), x1 = x0, o0 = x0, o1 = x0;
+    for (int i = 0; i < __4KB / 16; i += 2) {
+        __m128i a = _mm_loadu_si128(p + i);
+        __m128i b = _mm_loadu_si128(p + i + 1);
+        x0 = _mm_xor_si128(x0, a);
+        x1 = _mm_xor_si128(x1, b);
+        o0 = _mm_or_si128(o0, a);
+        o1 = _mm_or_si128(o1, b);
+    }
+    x0 = _mm_xor_si128(x0, x1);
+    o0 = _mm_or_si128(o0, o1);
+    *xs ^= _mm_cvtsi128_si64(x0) ^ _mm_cvtsi128_si64(_mm_unpackhi_epi64(x0, x0));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(o0, _mm_setzero_si128())) != 0xffff;
+}
+
+static uint64_t page_copy_sse2(void* dst, const void* src) {
+    const __m128i* s = src;
+    __m128i* d = dst;
+    __m128i x0 = _mm_setzero_si128(), x1 = x0;
+    for (int i = 0; i < __4KB / 16; i += 2) {
+        __m128i a = _mm_loadu_si128(s + i);
+        __m128i b = _mm_loadu_si128(s + i + 1);
+        _mm_storeu_si128(d + i, a);
+        _mm_storeu_si128(d + i + 1, b);
+        x0 = _mm_xor_si128(x0, a);
+        x1 = _mm_xor_si128(x1, b);
+    }
+    x0 = _mm_xor_si128(x0, x1);
+    return _mm_cvtsi128_si64(x0) ^ _mm_cvtsi128_si64(_mm_unpackhi_epi64(x0, x0));
+}
+
+static bool __attribute__((target("avx2"))) page_scan_avx2(const void* page, uint64_t* xs) {
+    const __m256i* p = page;
+    __m256i x0 = _mm256_setzero_si256(), x1 = x0, o0 = x0, o1 = x0;
+    for (int i = 0; i < __4KB / 32; i += 2) {
+        __m256i a = _mm256_loadu_si256(p + i);
+        __m256i b = _mm256_loadu_si256(p + i + 1);
+        x0 = _mm256_xor_si256(x0, a);
+        x1 = _mm256_xor_si256(x1, b);
+        o0 = _mm256_or_si256(o0, a);
+        o1 = _mm256_or_si256(o1, b);
+    }
+    x0 = _mm256_xor_si256(x0, x1);
+    o0 = _mm256_or_si256(o0, o1);
+    __m128i x = _mm_xor_si128(_mm256_castsi256_si128(x0), _mm256_extracti128_si256(x0, 1));
+    *xs ^= _mm_cvtsi128_si64(x) ^ _mm_extract_epi64(x, 1);
+    return !_mm256_testz_si256(o0, o0);
+}
+
+static uint64_t __attribute__((target("avx2"))) page_copy_avx2(void* dst, const void* src) {
+    const __m256i* s = src;
+    __m256i* d = dst;
+    __m256i x0 = _mm256_setzero_si256(), x1 = x0;
+    for (int i = 0; i < __4KB / 32; i += 2) {
+        __m256i a = _mm256_loadu_si256(s + i);
+        __m256i b = _mm256_loadu_si256(s + i + 1);
+        _mm256_storeu_si256(d + i, a);
+        _mm256_storeu_si256(d + i + 1, b);
+        x0 = _mm256_xor_si256(x0, a);
+        x1 = _mm256_xor_si256(x1, b);
+    }
+    x0 = _mm256_xor_si256(x0, x1);
+    __m128i x = _mm_xor_si128(_mm256_castsi256_si128(x0), _mm256_extracti128_si256(x0, 1));
+    return _mm_cvtsi128_si64(x) ^ _mm_extract_epi64(x, 1);
+}
+#endif
+
+// true if the page is not zero, *xs ^= its xor sum
+static bool (*page_scan)(const void* page, uint64_t* xs) = page_scan_generic;
+// copy a page, return its xor sum
+static uint64_t (*page_copy)(void* dst, const void* src) = page_copy_generic;
+
+static void __attribute__((constructor)) page_kernels_init(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        page_scan = page_scan_avx2;
+        page_copy = page_copy_avx2;
+    } else {
+        page_scan = page_scan_sse2;
+        page_copy = page_copy_sse2;
+    }
+#endif
+}
+
+// host threads leave the timer signals to the emulation thread
+static void create_host_thread(pthread_t* thread, void* (*fn)(void*), void* arg) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    lsassert(pthread_create(thread, NULL, fn, arg) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Worker threads for run_on_host_cores, created on first use and kept for
+ * the later checkpoints. A forked checkpoint writer or clone has none of
+ * them and creates its own.
+ */
+static struct {
+    pid_t pid;
+    long num;               // threads, the caller included
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    void* (*fn)(void*);
+    void* arg;
+    uint64_t generation;    // bumped for every job
+    long running;
+} host_pool;
+
+static void* host_pool_thread(void* arg) {
+    uint64_t generation = (uintptr_t)arg;
+    pthread_mutex_lock(&host_pool.lock);
+    while (1) {
+        while (host_pool.generation == generation) {
+            pthread_cond_wait(&host_pool.start, &host_pool.lock);
+        }
+        generation = host_pool.generation;
+        pthread_mutex_unlock(&host_pool.lock);
+        host_pool.fn(host_pool.arg);
+        pthread_mutex_lock(&host_pool.lock);
+        if (--host_pool.running == 0) {
+            pthread_cond_signal(&host_pool.done);
+        }
+    }
+    return NULL;
+}
+
+static long host_cores(void) {
+    return MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+}
+
+static void host_pool_init(long num) {
+    host_pool.pid = getpid();
+    host_pool.num = num;
+    pthread_mutex_init(&host_pool.lock, NULL);
+    pthread_cond_init(&host_pool.start, NULL);
+    pthread_cond_init(&host_pool.done, NULL);
+    for (long i = 1; i < host_pool.num; i++) {
+        pthread_t thread;
+        create_host_thread(&thread, host_pool_thread, (void*)(uintptr_t)host_pool.generation);
+        pthread_detach(thread);
+    }
+}
+
+// run fn(arg) on every online host core, the caller is one of them
+static void run_on_host_cores(void* (*fn)(void*), void* arg) {
+    if (host_pool.pid != getpid()) {
+        host_pool_init(host_cores());
+    }
+    pthread_mutex_lock(&host_pool.lock);
+    host_pool.fn = fn;
+    host_pool.arg = arg;
+    host_pool.running = host_pool.num - 1;
+    host_pool.generation++;
+    pthread_cond_broadcast(&host_pool.start);
+    pthread_mutex_unlock(&host_pool.lock);
+    fn(arg);
+    pthread_mutex_lock(&host_pool.lock);
+    while (host_pool.running) {
+        pthread_cond_wait(&host_pool.done, &host_pool.lock);
+    }
+    pthread_mutex_unlock(&host_pool.lock);
+}
+
+/*
+ * Split page_num pages across the host cores. fn gets blocks of
+ * PAGE_JOB_BLOCK pages, whole words of the ram bitmaps when the pages
+ * start at a multiple of it, and returns their part of the xor sum.
+ */
+#define PAGE_JOB_BLOCK 1024ul
+
+typedef struct PageJob PageJob;
+struct PageJob {
+    uint64_t (*fn)(PageJob* job, uint64_t begin, uint64_t end);
+    void* opaque;
+    uint64_t page_num;
+    uint64_t next_block;
+    uint64_t xs;
+};
+
+static void* page_job_worker(void* arg) {
+    PageJob* job = arg;
+    uint64_t xs = 0;
+    uint64_t block;
+    while ((block = qatomic_fetch_inc(&job->next_block)) * PAGE_JOB_BLOCK < job->page_num) {
+        uint64_t begin = block * PAGE_JOB_BLOCK;
+        xs ^= job->fn(job, begin, MIN(begin + PAGE_JOB_BLOCK, job->page_num));
+    }
+    qatomic_xor(&job->xs, xs);
+    return NULL;
+}
+
+static uint64_t run_page_job(PageJob* job) {
+    if (job->page_num <= PAGE_JOB_BLOCK) {
+        page_job_worker(job);
+    } else {
+        run_on_host_cores(page_job_worker, job);
+    }
+    return job->xs;
+}
+
+static void* map_file_nofail(const char* filename, int64_t* size) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        abort();
+    }
+    lsassert(fstat(fd, &st) == 0 && st.st_size > 0);
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    lsassertm(p != MAP_FAILED, "map %s failed, error:%s\n", filename, strerror(errno));
+    close(fd);
+    *size = st.st_size;
+    return p;
+}
+
+static void make_checkpoint_dir(CPULoongArchState *env, char* name, char* dir)
+{
+    fprintf(stderr, "checkpoint at icount:%ld\n", env->icount);
+
+    sprintf(dir, "%s_icount_%ld", name, env->icount);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: cannot create dir:%s\n", dir);
+        laemu_exit(1);
+    }
+}
+
+#if !defined(CONFIG_USER_ONLY)
+
 #define LOWMEM_BEGIN 0ul
 #define LOWMEM_SIZE 0x10000000ul
 #define HIGHMEM_BEGIN 0x90000000ul
@@ -29,20 +314,9 @@ extern char* ram;
 extern uint64_t ram_size;
 extern const char* const csrnames[];
 
-static void loongarch_cpu_dump_state(CPULoongArchState *env, FILE *f);
-static void loongarch_cpu_restore_state(CPULoongArchState *env, FILE *f);
 extern uint64_t helper_read_csr(CPULoongArchState *env, int csr_index);
 extern uint64_t helper_csrrd_pgd(CPULoongArchState*);
 
-static inline FILE* fopen_nofail(const char *__restrict __filename, const char *__restrict __modes) {
-    FILE* f = fopen(__filename, __modes);
-    if (!f) {
-        perror(__filename);
-        abort();
-    }
-    return f;
-}
-
 static void* fread_all_nofail(const char *__restrict __filename, int64_t* size) {
     FILE *f = fopen_nofail(__filename, "rb");
     fseek(f, 0, SEEK_END);
@@ -59,83 +333,945 @@ static void* fread_all_nofail(const char *__restrict __filename, int64_t* size)
 static uint64_t xor_sum(const void* buf, uint64_t size) {
     lsassert(size % __4KB == 0);
     uint64_t r = 0;
-    for(uint64_t addr = 0; addr < size; addr += 8) {
-        r ^= *(uint64_t*)((char*)buf + addr);
+    for(uint64_t addr = 0; addr < size; addr += __4KB) {
+        page_scan((char*)buf + addr, &r);
     }
     return r;
 }
 
-static uint64_t simple_compress(const char* filename, const void* buf, uint64_t size) {
+typedef struct ScanRange {
+    uint64_t base;
+    uint8_t* present;
+} ScanRange;
+
+static uint64_t scan_pages(PageJob* job, uint64_t begin, uint64_t end) {
+    ScanRange* r = job->opaque;
+    uint64_t xs = 0;
+    for (uint64_t i = begin; i < end; i++) {
+        uint64_t pa = r->base + i * __4KB;
+        r->present[i] = ram_page_used(pa) && page_scan(ram + pa, &xs);
+    }
+    return xs;
+}
+
+// the pages of [base, base + size) that are not zero, return their xor sum
+static uint64_t scan_ram(uint64_t base, uint64_t size, uint8_t* present) {
+    ScanRange r = { .base = base, .present = present };
+    PageJob job = { .fn = scan_pages, .opaque = &r, .page_num = size / __4KB };
+    return run_page_job(&job);
+}
+
+typedef struct CopyRange {
+    uint64_t base;
+    const uint8_t* input;
+    const uint64_t* offset; // of every page in input, 0 for a zero page
+} CopyRange;
+
+static uint64_t copy_pages(PageJob* job, uint64_t begin, uint64_t end) {
+    CopyRange* r = job->opaque;
+    uint64_t xs = 0;
+    for (uint64_t i = begin; i < end; i++) {
+        if (r->offset[i]) {
+            xs ^= page_copy(ram + r->base + i * __4KB, r->input + r->offset[i]);
+        }
+    }
+    return xs;
+}
+
+// pages never written since boot or restore are known to be zero, see ram_used
+static uint64_t simple_compress(const char* filename, uint64_t base_addr, uint64_t size) {
     FILE* f = fopen_nofail(filename, "wb");
     lsassert(size % __4KB == 0);
-    uint64_t present_cnt = 0;
-    int64_t present = 0;
-    for(uint64_t addr = 0; addr < size; addr += __4KB) {
-        if (memcmp((char*)buf + addr, zero4k, __4KB)) {
-            present = 1;
-            ++ present_cnt;
-            lsassert(fwrite(&present, sizeof(present), 1, f) == 1);
-            lsassert(fwrite((char*)buf + addr, __4KB, 1, f) == 1);
-        } else {
-            present = 0;
-            lsassert(fwrite(&present, sizeof(present), 1, f) == 1);
+    uint64_t page_num = size / __4KB;
+    uint8_t* present = malloc(page_num);
+    uint64_t xs = scan_ram(base_addr, size, present);
+    for (uint64_t i = 0; i < page_num; i++) {
+        int64_t flag = present[i];
+        lsassert(fwrite(&flag, sizeof(flag), 1, f) == 1);
+        if (flag) {
+            lsassert(fwrite(ram + base_addr + i * __4KB, __4KB, 1, f) == 1);
         }
     }
-    uint64_t xs = xor_sum(buf, size);
     lsassert(fwrite(&xs, sizeof(xs), 1, f) == 1);
     fclose(f);
+    free(present);
     return xs;
 }
 
 static uint64_t simple_decompress(const char* filename, uint64_t base_addr, uint64_t size) {
     lsassert(size % __4KB == 0);
     int64_t input_size;
-    void* input_buf =  fread_all_nofail(filename, &input_size);
+    uint8_t* input_buf = map_file_nofail(filename, &input_size);
+    uint64_t page_num = size / __4KB;
+    uint64_t* offset = malloc(page_num * sizeof(uint64_t));
     uint64_t index = 0;
-    uint64_t xs = 0;
-    for(uint64_t addr = 0; addr < size; addr += __4KB) {
-        int64_t present = *(int64_t *)((uint8_t*)input_buf + index);
+    // find every page first, the copy is split across the host cores
+    for (uint64_t i = 0; i < page_num; i++) {
+        lsassertm(index + 8 <= input_size, "%s is truncated\n", filename);
+        int64_t present = *(int64_t *)(input_buf + index);
         index += 8;
+        offset[i] = 0;
         if (present) {
-            memcpy(ram + base_addr + addr, (uint8_t*)input_buf + index, __4KB);
-            xs ^= xor_sum((uint8_t*)input_buf + index, __4KB);
+            offset[i] = index;
+            ram_set_dirty(base_addr + i * __4KB);
             index += __4KB;
         }
         // zero page need not copy
     }
-    printf("my:%lx input:%lx\n", xs, *(int64_t *)((uint8_t*)input_buf + index));
-    printf("index:%lx, input_size:%lx\n", index, input_size);
-    lsassert(xs == *(int64_t *)((uint8_t*)input_buf + index));
-    lsassert(index + 8 == input_size);
-    free(input_buf);
+    lsassertm(index + 8 <= input_size, "%s is truncated\n", filename);
+    CopyRange r = { .base = base_addr, .input = input_buf, .offset = offset };
+    PageJob job = { .fn = copy_pages, .opaque = &r, .page_num = page_num };
+    uint64_t xs = run_page_job(&job);
+    lsassertm(xs == *(int64_t *)(input_buf + index) && index + 8 == input_size, "%s is corrupted\n", filename);
+    munmap(input_buf, input_size);
+    free(offset);
     return xs;
 }
 
-void save_checkpoint(CPULoongArchState *env, char* name)
-{
-    FILE *f;
-    char filename[1024];
+/*
+ * Compressed checkpoints (--ckpt-lz), mem.lz instead of lowmem.c.bin and
+ * highmem.c.bin. LOWMEM and HIGHMEM are cut into LZ_CHUNK_SIZE chunks,
+ * compressed with lz.c by every host core at once:
 
-    fprintf(stderr, "checkpoint at icount:%ld\n", env->icount);
+       offset       field       size
+       ------------------------------------
+       0x0          magic       8
+       0x8          chunk_size  8
+       0x10         chunk_num   8
+       0x18         index       chunk_num * sizeof(LZChunk)
+       ...          chunks      in the order they were finished
+
+ * A zero chunk has size 0 and no data, a chunk that does not compress is
+ * kept as is with size == chunk_size.
+ */
+#define LZ_MAGIC 0x315a4c554d45414cul  // "LAEMULZ1"
+#define LZ_CHUNK_SIZE SZ_1M
+
+typedef struct LZChunk {
+    uint64_t pa;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t xor_sum;   // of the uncompressed chunk
+} LZChunk;
+
+typedef struct LZJob {
+    int fd;
+    LZChunk* index;
+    uint64_t chunk_num;
+    uint64_t next_chunk;    // the next one for a worker to take
+    uint64_t file_end;      // the next chunk data is written there
+} LZJob;
+
+bool ckpt_lz;
+
+static uint64_t lz_chunk_pa(uint64_t i) {
+    uint64_t low_num = LOWMEM_SIZE / LZ_CHUNK_SIZE;
+    return i < low_num ? LOWMEM_BEGIN + i * LZ_CHUNK_SIZE : HIGHMEM_BEGIN + (i - low_num) * LZ_CHUNK_SIZE;
+}
 
-    sprintf(filename, "%s_icount_%ld", name, env->icount);
+// true if the chunk is not zero, *xs is its xor sum
+static bool lz_chunk_scan(uint64_t pa, uint64_t* xs) {
+    bool present = false;
+    *xs = 0;
+    for (uint64_t addr = pa; addr < pa + LZ_CHUNK_SIZE; addr += __4KB) {
+        if (ram_page_used(addr) && page_scan(ram + addr, xs)) {
+            present = true;
+        }
+    }
+    return present;
+}
 
-    if (mkdir(filename, 0755) < 0 && errno != EEXIST) {
-        fprintf(stderr, "ERROR: cannot create dir:%s\n", filename);
+static void* lz_compress_worker(void* arg) {
+    LZJob* job = arg;
+    uint8_t* buf = malloc(LZ_CHUNK_SIZE);
+    uint64_t i;
+    while ((i = qatomic_fetch_inc(&job->next_chunk)) < job->chunk_num) {
+        LZChunk* c = &job->index[i];
+        c->pa = lz_chunk_pa(i);
+        if (!lz_chunk_scan(c->pa, &c->xor_sum)) {
+            continue;
+        }
+        const uint8_t* data = (uint8_t*)ram + c->pa;
+        int64_t size = lz_compress(data, LZ_CHUNK_SIZE, buf, LZ_CHUNK_SIZE - 1);
+        if (size < 0) {
+            size = LZ_CHUNK_SIZE;
+        } else {
+            data = buf;
+        }
+        c->size = size;
+        c->offset = qatomic_fetch_add(&job->file_end, size);
+        lsassert(pwrite(job->fd, data, size, c->offset) == size);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void* lz_decompress_worker(void* arg) {
+    LZJob* job = arg;
+    uint8_t* buf = malloc(LZ_CHUNK_SIZE);
+    uint64_t i;
+    while ((i = qatomic_fetch_inc(&job->next_chunk)) < job->chunk_num) {
+        LZChunk* c = &job->index[i];
+        if (!c->size) {
+            continue;
+        }
+        lsassertm(c->pa % LZ_CHUNK_SIZE == 0 && c->size <= LZ_CHUNK_SIZE &&
+                  ((c->pa >= LOWMEM_BEGIN && c->pa < LOWMEM_BEGIN + LOWMEM_SIZE) ||
+                   (c->pa >= HIGHMEM_BEGIN && c->pa < HIGHMEM_BEGIN + HIGHMEM_SIZE)),
+                  "bad chunk %lx in mem.lz\n", i);
+        uint8_t* dst = (uint8_t*)ram + c->pa;
+        if (c->size == LZ_CHUNK_SIZE) {
+            lsassert(pread(job->fd, dst, LZ_CHUNK_SIZE, c->offset) == LZ_CHUNK_SIZE);
+        } else {
+            lsassert(pread(job->fd, buf, c->size, c->offset) == c->size);
+            lsassertm(lz_decompress(buf, c->size, dst, LZ_CHUNK_SIZE) == LZ_CHUNK_SIZE,
+                      "chunk %lx of mem.lz is corrupted\n", c->pa);
+        }
+        lsassertm(xor_sum(dst, LZ_CHUNK_SIZE) == c->xor_sum, "chunk %lx of mem.lz is corrupted\n", c->pa);
+        // a chunk covers whole words of the bitmaps, no other worker touches them
+        ram_set_dirty_range(c->pa, LZ_CHUNK_SIZE);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void save_memory_lz(const char* filename) {
+    LZJob job = {
+        .chunk_num = (LOWMEM_SIZE + HIGHMEM_SIZE) / LZ_CHUNK_SIZE,
+    };
+    uint64_t header[3] = {LZ_MAGIC, LZ_CHUNK_SIZE, job.chunk_num};
+    uint64_t index_size = job.chunk_num * sizeof(LZChunk);
+    job.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job.fd < 0) {
+        perror(filename);
+        abort();
+    }
+    job.index = calloc(job.chunk_num, sizeof(LZChunk));
+    job.file_end = sizeof(header) + index_size;
+    run_on_host_cores(lz_compress_worker, &job);
+    lsassert(pwrite(job.fd, header, sizeof(header), 0) == sizeof(header));
+    lsassert(pwrite(job.fd, job.index, index_size, sizeof(header)) == index_size);
+    close(job.fd);
+    free(job.index);
+    fprintf(stderr, "lz checkpoint, %ld bytes\n", job.file_end);
+}
+
+static void restore_memory_lz(const char* filename) {
+    LZJob job = {};
+    uint64_t header[3];
+    job.fd = open(filename, O_RDONLY);
+    if (job.fd < 0) {
+        perror(filename);
+        abort();
+    }
+    lsassertm(pread(job.fd, header, sizeof(header), 0) == sizeof(header) && header[0] == LZ_MAGIC,
+              "%s is not a lz checkpoint\n", filename);
+    lsassertm(header[1] == LZ_CHUNK_SIZE, "%s has chunk size %lx\n", filename, header[1]);
+    job.chunk_num = header[2];
+    job.index = malloc(job.chunk_num * sizeof(LZChunk));
+    lsassert(pread(job.fd, job.index, job.chunk_num * sizeof(LZChunk), sizeof(header)) == job.chunk_num * sizeof(LZChunk));
+    run_on_host_cores(lz_decompress_worker, &job);
+    close(job.fd);
+    free(job.index);
+}
+
+/*
+ * Lazy restore (--ckpt-lazy), guest pages are filled when they are first
+ * touched instead of before the first instruction:
+ * mem.lz: ram is registered to a userfaultfd, a handler thread fills the
+ * whole chunk of a missing page. main() only allows it on anonymous ram,
+ * where UFFDIO_ZEROPAGE works.
+ * mem.bin of --ckpt-mem: the present pages are mapped privately from the file.
+ * The other formats are always read at once. Checksums are only checked on
+ * the chunks that get filled.
+ */
+bool ckpt_lazy;
+
+typedef struct LZLazy {
+    LZJob job;
+    int uffd;
+    int stop[2];            // a pipe to stop the handler
+    pthread_t handler;
+    pthread_mutex_t lock;   // held while filling
+    uint8_t* filled;        // per chunk
+    uint64_t filled_num;
+    uint8_t* buf;
+} LZLazy;
+
+static LZLazy* lz_lazy;
+
+static uint64_t lz_chunk_index(uint64_t pa) {
+    if (pa < LOWMEM_BEGIN + LOWMEM_SIZE) {
+        return (pa - LOWMEM_BEGIN) / LZ_CHUNK_SIZE;
+    }
+    return LOWMEM_SIZE / LZ_CHUNK_SIZE + (pa - HIGHMEM_BEGIN) / LZ_CHUNK_SIZE;
+}
+
+static void uffd_register(int uffd, uint64_t pa, uint64_t size) {
+    struct uffdio_register reg = {
+        .range = { .start = (uint64_t)ram + pa, .len = size },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    lsassertm(ioctl(uffd, UFFDIO_REGISTER, &reg) == 0, "userfaultfd register failed, error:%s\n", strerror(errno));
+}
+
+// src NULL for zero pages, pages already present are left as they are
+static void uffd_fill(int uffd, uint8_t* dst, const uint8_t* src, uint64_t size) {
+    uint64_t off = 0;
+    while (off < size) {
+        int64_t done;
+        int r;
+        if (src) {
+            struct uffdio_copy copy = { .dst = (uint64_t)dst + off, .src = (uint64_t)src + off, .len = size - off };
+            r = ioctl(uffd, UFFDIO_COPY, &copy);
+            done = copy.copy;
+        } else {
+            struct uffdio_zeropage zero = { .range = { .start = (uint64_t)dst + off, .len = size - off } };
+            r = ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+            done = zero.zeropage;
+        }
+        if (r == 0) {
+            return;
+        }
+        if (errno == EAGAIN && done > 0) {
+            off += done;
+        } else {
+            lsassertm(errno == EEXIST, "userfaultfd fill failed, error:%s\n", strerror(errno));
+            off += __4KB;
+        }
+    }
+}
+
+static void lz_lazy_fill(LZLazy* lz, uint64_t i) {
+    if (lz->filled[i]) {
+        return;
+    }
+    LZChunk* c = &lz->job.index[i];
+    uint8_t* dst = (uint8_t*)ram + c->pa;
+    lsassertm(c->pa == lz_chunk_pa(i) && c->size <= LZ_CHUNK_SIZE, "bad chunk %lx in mem.lz\n", i);
+    if (!c->size) {
+        uffd_fill(lz->uffd, dst, NULL, LZ_CHUNK_SIZE);
+    } else {
+        uint8_t* data = lz->buf + LZ_CHUNK_SIZE;
+        if (c->size == LZ_CHUNK_SIZE) {
+            lsassert(pread(lz->job.fd, lz->buf, LZ_CHUNK_SIZE, c->offset) == LZ_CHUNK_SIZE);
+        } else {
+            lsassert(pread(lz->job.fd, data, c->size, c->offset) == c->size);
+            lsassertm(lz_decompress(data, c->size, lz->buf, LZ_CHUNK_SIZE) == LZ_CHUNK_SIZE,
+                      "chunk %lx of mem.lz is corrupted\n", c->pa);
+        }
+        lsassertm(xor_sum(lz->buf, LZ_CHUNK_SIZE) == c->xor_sum, "chunk %lx of mem.lz is corrupted\n", c->pa);
+        uffd_fill(lz->uffd, dst, lz->buf, LZ_CHUNK_SIZE);
+    }
+    lz->filled[i] = 1;
+    lz->filled_num ++;
+}
+
+static void* lz_lazy_handler(void* arg) {
+    LZLazy* lz = arg;
+    struct pollfd fds[2] = {
+        { .fd = lz->uffd, .events = POLLIN },
+        { .fd = lz->stop[0], .events = POLLIN },
+    };
+    for (;;) {
+        struct uffd_msg msg;
+        if (poll(fds, 2, -1) < 0) {
+            lsassert(errno == EINTR);
+            continue;
+        }
+        if (fds[1].revents) {
+            return NULL;
+        }
+        if (read(lz->uffd, &msg, sizeof(msg)) != sizeof(msg) || msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        uint64_t pa = msg.arg.pagefault.address - (uint64_t)ram;
+        uint64_t i = lz_chunk_index(pa);
+        pthread_mutex_lock(&lz->lock);
+        if (lz->filled[i]) {
+            // filled after this fault was queued
+            struct uffdio_range range = { .start = (uint64_t)ram + lz->job.index[i].pa, .len = LZ_CHUNK_SIZE };
+            ioctl(lz->uffd, UFFDIO_WAKE, &range);
+        }
+        lz_lazy_fill(lz, i);
+        pthread_mutex_unlock(&lz->lock);
+    }
+}
+
+static void restore_memory_lz_lazy(const char* filename) {
+    LZLazy* lz = calloc(1, sizeof(LZLazy));
+    uint64_t header[3];
+    lz->job.fd = open(filename, O_RDONLY);
+    if (lz->job.fd < 0) {
+        perror(filename);
+        abort();
+    }
+    lsassertm(pread(lz->job.fd, header, sizeof(header), 0) == sizeof(header) && header[0] == LZ_MAGIC,
+              "%s is not a lz checkpoint\n", filename);
+    lsassertm(header[1] == LZ_CHUNK_SIZE, "%s has chunk size %lx\n", filename, header[1]);
+    lsassertm(header[2] == (LOWMEM_SIZE + HIGHMEM_SIZE) / LZ_CHUNK_SIZE, "%s has %ld chunks\n", filename, header[2]);
+    lz->job.chunk_num = header[2];
+    lz->job.index = malloc(lz->job.chunk_num * sizeof(LZChunk));
+    lsassert(pread(lz->job.fd, lz->job.index, lz->job.chunk_num * sizeof(LZChunk), sizeof(header)) == lz->job.chunk_num * sizeof(LZChunk));
+    lz->filled = calloc(lz->job.chunk_num, 1);
+    // the chunk, then the compressed data it comes from
+    lz->buf = malloc(LZ_CHUNK_SIZE * 2);
+    pthread_mutex_init(&lz->lock, NULL);
+
+    lz->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    lsassertm(lz->uffd >= 0, "userfaultfd failed, error:%s, check /proc/sys/vm/unprivileged_userfaultfd\n", strerror(errno));
+    struct uffdio_api api = { .api = UFFD_API };
+    lsassertm(ioctl(lz->uffd, UFFDIO_API, &api) == 0, "userfaultfd api failed, error:%s\n", strerror(errno));
+    uffd_register(lz->uffd, LOWMEM_BEGIN, LOWMEM_SIZE);
+    uffd_register(lz->uffd, HIGHMEM_BEGIN, HIGHMEM_SIZE);
+    for (uint64_t i = 0; i < lz->job.chunk_num; i++) {
+        if (lz->job.index[i].size) {
+            ram_set_dirty_range(lz->job.index[i].pa, LZ_CHUNK_SIZE);
+        }
+    }
+    lsassert(pipe(lz->stop) == 0);
+    lz_lazy = lz;
+    create_host_thread(&lz->handler, lz_lazy_handler, lz);
+}
+
+// fill every chunk left and drop the userfaultfd, a fork needs it
+void ckpt_lazy_finish(void) {
+    LZLazy* lz = lz_lazy;
+    if (!lz) {
+        return;
+    }
+    pthread_mutex_lock(&lz->lock);
+    uint64_t touched = lz->filled_num;
+    for (uint64_t i = 0; i < lz->job.chunk_num; i++) {
+        lz_lazy_fill(lz, i);
+    }
+    pthread_mutex_unlock(&lz->lock);
+    lsassert(write(lz->stop[1], "", 1) == 1);
+    pthread_join(lz->handler, NULL);
+    fprintf(stderr, "lazy restore finished, %ld of %ld chunks were touched\n", touched, lz->job.chunk_num);
+    close(lz->uffd);
+    close(lz->stop[0]);
+    close(lz->stop[1]);
+    close(lz->job.fd);
+    free(lz->job.index);
+    free(lz->filled);
+    free(lz->buf);
+    free(lz);
+    lz_lazy = NULL;
+}
+
+/*
+ * Delta checkpoints (--ckpt-delta). A checkpoint directory holds either
+ * lowmem.c.bin/highmem.c.bin, mem.lz or manifest.bin, or delta.bin plus a
+ * "parent" file naming the checkpoint it was taken after. delta.bin has the
+ * pages written since the parent, see ram_dirty:
+
+       offset       field       size
+       ------------------------------------
+       0x0          magic       8
+       0x8          page_num    8
+       0x10         pages       page_num * (8 [+ 4K])
+       end - 8      xor_sum     8
+
+ * Each page is its pa, bit 0 set for a zero page that has no data.
+ */
+#define DELTA_MAGIC 0x31544c4544414c00ul  // "\0LADELT1"
+#define DELTA_ZERO_PAGE 1ul
+
+bool ckpt_delta;
+// the last checkpoint saved or restored, parent of the next delta
+static char ckpt_parent[PATH_MAX];
+
+static void write_delta_range(FILE* f, uint64_t begin, uint64_t size, uint64_t* page_num, uint64_t* xs) {
+    for (uint64_t page = begin >> TARGET_PAGE_BITS; page < (begin + size) >> TARGET_PAGE_BITS; page++) {
+        if (!ram_dirty[BIT_WORD(page)]) {
+            page |= BITS_PER_LONG - 1;
+            continue;
+        }
+        if (!test_bit(page, ram_dirty)) {
+            continue;
+        }
+        uint64_t pa = page << TARGET_PAGE_BITS;
+        if (page_scan(ram + pa, xs)) {
+            lsassert(fwrite(&pa, sizeof(pa), 1, f) == 1);
+            lsassert(fwrite(ram + pa, __4KB, 1, f) == 1);
+        } else {
+            pa |= DELTA_ZERO_PAGE;
+            lsassert(fwrite(&pa, sizeof(pa), 1, f) == 1);
+        }
+        ++ *page_num;
+    }
+}
+
+static void save_delta(const char* filename) {
+    FILE* f = fopen_nofail(filename, "wb");
+    uint64_t header[2] = {DELTA_MAGIC, 0};
+    uint64_t xs = 0;
+    lsassert(fwrite(header, sizeof(header), 1, f) == 1);
+    write_delta_range(f, LOWMEM_BEGIN, LOWMEM_SIZE, &header[1], &xs);
+    write_delta_range(f, HIGHMEM_BEGIN, HIGHMEM_SIZE, &header[1], &xs);
+    lsassert(fwrite(&xs, sizeof(xs), 1, f) == 1);
+    fseek(f, 0, SEEK_SET);
+    lsassert(fwrite(header, sizeof(header), 1, f) == 1);
+    fclose(f);
+    fprintf(stderr, "delta checkpoint, %ld pages since %s\n", header[1], ckpt_parent);
+}
+
+static void restore_delta(const char* filename) {
+    int64_t input_size;
+    uint8_t* input_buf = fread_all_nofail(filename, &input_size);
+    uint64_t* header = (uint64_t*)input_buf;
+    lsassertm(input_size >= 24 && header[0] == DELTA_MAGIC, "%s is not a delta checkpoint\n", filename);
+    uint64_t index = sizeof(uint64_t) * 2;
+    uint64_t xs = 0;
+    for (uint64_t i = 0; i < header[1]; i++) {
+        lsassertm(index + 8 <= input_size, "%s is truncated\n", filename);
+        uint64_t pa = *(uint64_t*)(input_buf + index);
+        uint64_t page = pa & ~DELTA_ZERO_PAGE;
+        index += 8;
+        lsassertm(!(page & (__4KB - 1)) && addr_in_ram(page), "%s has page %lx outside ram\n", filename, page);
+        if (pa & DELTA_ZERO_PAGE) {
+            memset(ram + page, 0, __4KB);
+        } else {
+            lsassertm(index + __4KB <= input_size, "%s is truncated\n", filename);
+            xs ^= page_copy(ram + pa, input_buf + index);
+            index += __4KB;
+        }
+        ram_set_dirty(page);
+    }
+    lsassertm(index + 8 == input_size && xs == *(uint64_t*)(input_buf + index), "%s is corrupted\n", filename);
+    free(input_buf);
+}
+
+// the parent is stored relative to the checkpoint when both are in one directory
+static void save_parent(const char* dir) {
+    char filename[PATH_MAX + 16];
+    char* dir_real = realpath(dir, NULL);
+    lsassert(dir_real);
+    size_t n = strrchr(dir_real, '/') - dir_real + 1;
+    bool sibling = strncmp(dir_real, ckpt_parent, n) == 0 && !strchr(ckpt_parent + n, '/');
+    snprintf(filename, sizeof(filename), "%s/parent", dir);
+    FILE* f = fopen_nofail(filename, "w");
+    fprintf(f, sibling ? "../%s\n" : "%s\n", sibling ? ckpt_parent + n : ckpt_parent);
+    fclose(f);
+    free(dir_real);
+}
+
+static bool read_parent(const char* dir, char* parent) {
+    char filename[PATH_MAX + 16];
+    char buffer[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/parent", dir);
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        return false;
+    }
+    lsassert(fgets(buffer, sizeof(buffer), f));
+    fclose(f);
+    buffer[strcspn(buffer, "\n")] = 0;
+    if (buffer[0] == '/') {
+        strcpy(parent, buffer);
+    } else {
+        snprintf(parent, PATH_MAX, "%s/%s", dir, buffer);
+    }
+    return true;
+}
+
+/*
+ * Page store (--ckpt-store dir), checkpoints share one pool of pages and
+ * each holds manifest.bin plus a "store" file naming the pool. The pool is
+ * pages.bin with page n at n * 4K, and pages.idx with the hash of page n at
+ * n * 16. A page is added only if no equal page is there, the hash finds
+ * the candidate and the pooled page is compared. Writers take flock on
+ * pages.idx. manifest.bin lists the pages that are not zero:
+
+       offset       field       size
+       ------------------------------------
+       0x0          magic       8
+       0x8          page_num    8
+       0x10         pages       page_num * sizeof(ManifestEntry)
+ */
+#define MANIFEST_MAGIC 0x3146494e414d414cul  // "LAMANIF1"
+
+typedef struct ManifestEntry {
+    uint64_t pa;
+    uint64_t page;      // in pages.bin
+    uint64_t hash[2];
+} ManifestEntry;
+
+typedef struct PageStore {
+    int data_fd;
+    int idx_fd;
+    uint64_t page_num;
+    uint64_t new_num;
+    uint64_t (*hashes)[2];  // of every page in the pool
+    uint64_t hashes_size;
+    uint64_t* table;        // page + 1 by hash, 0 for empty
+    uint64_t table_size;
+} PageStore;
+
+char* ckpt_store;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdul;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ul;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64_128 of a page
+static void page_hash(const void* page, uint64_t hash[2]) {
+    const uint64_t c1 = 0x87c37b91114253d5ul;
+    const uint64_t c2 = 0x4cf5ad432745937ful;
+    const uint64_t* blocks = page;
+    uint64_t h1 = 0, h2 = 0;
+    for (int i = 0; i < __4KB / 16; i++) {
+        uint64_t k1 = blocks[i * 2];
+        uint64_t k2 = blocks[i * 2 + 1];
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    h1 ^= __4KB;
+    h2 ^= __4KB;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+static uint64_t* page_store_slot(PageStore* s, const uint64_t hash[2]) {
+    uint64_t i = hash[0] & (s->table_size - 1);
+    while (s->table[i] && memcmp(s->hashes[s->table[i] - 1], hash, 16)) {
+        i = (i + 1) & (s->table_size - 1);
+    }
+    return &s->table[i];
+}
+
+// keep the table at most half full
+static void page_store_grow(PageStore* s) {
+    if (s->page_num * 2 < s->table_size) {
+        return;
+    }
+    free(s->table);
+    s->table_size = MAX(s->table_size * 2, 1ul << 16);
+    s->table = calloc(s->table_size, sizeof(uint64_t));
+    for (uint64_t page = 0; page < s->page_num; page++) {
+        *page_store_slot(s, s->hashes[page]) = page + 1;
+    }
+}
+
+static void page_store_open(PageStore* s, const char* dir) {
+    char filename[PATH_MAX + 16];
+    memset(s, 0, sizeof(*s));
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: cannot create dir:%s\n", dir);
         laemu_exit(1);
     }
+    snprintf(filename, sizeof(filename), "%s/pages.bin", dir);
+    s->data_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    lsassertm(s->data_fd >= 0, "can not open %s, error:%s\n", filename, strerror(errno));
+    snprintf(filename, sizeof(filename), "%s/pages.idx", dir);
+    s->idx_fd = open(filename, O_RDWR | O_CREAT, 0644);
+    lsassertm(s->idx_fd >= 0, "can not open %s, error:%s\n", filename, strerror(errno));
+    lsassert(flock(s->idx_fd, LOCK_EX) == 0);
+    // a page is in the pool once its hash is, pages.bin may have more
+    s->page_num = lseek(s->idx_fd, 0, SEEK_END) / 16;
+    s->hashes_size = MAX(s->page_num * 2, 1ul << 16);
+    s->hashes = malloc(s->hashes_size * 16);
+    lsassert(pread(s->idx_fd, s->hashes, s->page_num * 16, 0) == s->page_num * 16);
+    page_store_grow(s);
+}
+
+static uint64_t page_store_add(PageStore* s, const void* data, uint64_t hash[2]) {
+    uint64_t* slot = page_store_slot(s, hash);
+    if (*slot) {
+        // equal hashes do not prove equal pages, a page that collides is
+        // added again and only found through the manifests naming it
+        uint8_t pooled[__4KB];
+        lsassert(pread(s->data_fd, pooled, __4KB, (*slot - 1) * __4KB) == __4KB);
+        if (!memcmp(pooled, data, __4KB)) {
+            return *slot - 1;
+        }
+        slot = NULL;
+    }
+    uint64_t page = s->page_num;
+    lsassert(pwrite(s->data_fd, data, __4KB, page * __4KB) == __4KB);
+    lsassert(pwrite(s->idx_fd, hash, 16, page * 16) == 16);
+    if (page == s->hashes_size) {
+        s->hashes_size *= 2;
+        s->hashes = realloc(s->hashes, s->hashes_size * 16);
+    }
+    memcpy(s->hashes[page], hash, 16);
+    if (slot) {
+        *slot = page + 1;
+    }
+    s->page_num ++;
+    s->new_num ++;
+    page_store_grow(s);
+    return page;
+}
+
+static void page_store_close(PageStore* s) {
+    close(s->data_fd);
+    close(s->idx_fd);
+    free(s->hashes);
+    free(s->table);
+}
+
+static void save_manifest_range(FILE* f, PageStore* s, uint64_t begin, uint64_t size, uint64_t* page_num) {
+    uint64_t xs = 0;
+    for (uint64_t pa = begin; pa < begin + size; pa += __4KB) {
+        if (!ram_page_used(pa) || !page_scan(ram + pa, &xs)) {
+            continue;
+        }
+        ManifestEntry e = { .pa = pa };
+        page_hash(ram + pa, e.hash);
+        e.page = page_store_add(s, ram + pa, e.hash);
+        lsassert(fwrite(&e, sizeof(e), 1, f) == 1);
+        ++ *page_num;
+    }
+}
+
+static void save_manifest(const char* dir) {
+    char filename[PATH_MAX + 16];
+    char* store_real;
+    PageStore s;
+    page_store_open(&s, ckpt_store);
+    snprintf(filename, sizeof(filename), "%s/manifest.bin", dir);
+    FILE* f = fopen_nofail(filename, "wb");
+    uint64_t header[2] = {MANIFEST_MAGIC, 0};
+    lsassert(fwrite(header, sizeof(header), 1, f) == 1);
+    save_manifest_range(f, &s, LOWMEM_BEGIN, LOWMEM_SIZE, &header[1]);
+    save_manifest_range(f, &s, HIGHMEM_BEGIN, HIGHMEM_SIZE, &header[1]);
+    fseek(f, 0, SEEK_SET);
+    lsassert(fwrite(header, sizeof(header), 1, f) == 1);
+    fclose(f);
+    fprintf(stderr, "store checkpoint, %ld pages, %ld new, %ld in %s\n", header[1], s.new_num, s.page_num, ckpt_store);
+    page_store_close(&s);
+
+    store_real = realpath(ckpt_store, NULL);
+    lsassert(store_real);
+    snprintf(filename, sizeof(filename), "%s/store", dir);
+    f = fopen_nofail(filename, "w");
+    fprintf(f, "%s\n", store_real);
+    fclose(f);
+    free(store_real);
+}
+
+static void restore_manifest(const char* dir) {
+    char filename[PATH_MAX + 16];
+    char store[PATH_MAX];
+    int64_t input_size;
+    snprintf(filename, sizeof(filename), "%s/store", dir);
+    FILE* f = fopen_nofail(filename, "r");
+    lsassert(fgets(store, sizeof(store), f));
+    fclose(f);
+    store[strcspn(store, "\n")] = 0;
+    snprintf(filename, sizeof(filename), "%s/pages.bin", store);
+    int fd = open(filename, O_RDONLY);
+    lsassertm(fd >= 0, "can not open %s, error:%s\n", filename, strerror(errno));
+
+    snprintf(filename, sizeof(filename), "%s/manifest.bin", dir);
+    uint64_t* header = fread_all_nofail(filename, &input_size);
+    lsassertm(input_size >= 16 && header[0] == MANIFEST_MAGIC &&
+              input_size == 16 + header[1] * sizeof(ManifestEntry), "%s is not a manifest\n", filename);
+    ManifestEntry* e = (ManifestEntry*)&header[2];
+    for (uint64_t i = 0; i < header[1]; i++) {
+        lsassertm(!(e[i].pa & (__4KB - 1)) && addr_in_ram(e[i].pa), "%s has page %lx outside ram\n", filename, e[i].pa);
+    }
+    for (uint64_t i = 0, n; i < header[1]; i += n) {
+        // pages saved in a row are mostly in a row in the pool too
+        for (n = 1; i + n < header[1] && e[i + n].pa == e[i].pa + n * __4KB && e[i + n].page == e[i].page + n; n++) {
+        }
+        lsassert(pread(fd, ram + e[i].pa, n * __4KB, e[i].page * __4KB) == n * __4KB);
+        for (uint64_t j = i; j < i + n; j++) {
+            uint64_t hash[2];
+            page_hash(ram + e[j].pa, hash);
+            lsassertm(hash[0] == e[j].hash[0] && hash[1] == e[j].hash[1], "page %lx of %s is corrupted\n", e[j].pa, dir);
+            ram_set_dirty(e[j].pa);
+        }
+    }
+    close(fd);
+    free(header);
+}
 
-    sprintf(filename, "%s_icount_%ld/lowmem.c.bin", name, env->icount);
-    simple_compress(filename, (void*)(ram + LOWMEM_BEGIN), LOWMEM_SIZE);
-    sprintf(filename, "%s_icount_%ld/highmem.c.bin", name, env->icount);
-    simple_compress(filename, (void*)(ram + HIGHMEM_BEGIN), HIGHMEM_SIZE);
+// memory of a checkpoint, a delta replays its parents first
+static void restore_checkpoint_memory(const char* image_dir) {
+    char filename[PATH_MAX + 16];
+    char parent[PATH_MAX];
+    if (read_parent(image_dir, parent)) {
+        restore_checkpoint_memory(parent);
+        fprintf(stderr, "load delta ckpt, from directory \"%s\"\n", image_dir);
+        snprintf(filename, sizeof(filename), "%s/delta.bin", image_dir);
+        restore_delta(filename);
+        return;
+    }
+    snprintf(filename, sizeof(filename), "%s/manifest.bin", image_dir);
+    if (access(filename, F_OK) == 0) {
+        restore_manifest(image_dir);
+        return;
+    }
+    snprintf(filename, sizeof(filename), "%s/mem.lz", image_dir);
+    if (access(filename, F_OK) == 0 && ckpt_lazy) {
+        restore_memory_lz_lazy(filename);
+    } else if (access(filename, F_OK) == 0) {
+        restore_memory_lz(filename);
+    } else {
+        snprintf(filename, sizeof(filename), "%s/lowmem.c.bin", image_dir);
+        simple_decompress(filename, LOWMEM_BEGIN, LOWMEM_SIZE);
+        snprintf(filename, sizeof(filename), "%s/highmem.c.bin", image_dir);
+        simple_decompress(filename, HIGHMEM_BEGIN, HIGHMEM_SIZE);
+    }
+}
+
+// memory of a standalone checkpoint
+static void save_checkpoint_memory(const char* dir) {
+    char filename[PATH_MAX + 16];
+    if (ckpt_store) {
+        save_manifest(dir);
+    } else if (ckpt_lz) {
+        snprintf(filename, sizeof(filename), "%s/mem.lz", dir);
+        save_memory_lz(filename);
+    } else {
+        snprintf(filename, sizeof(filename), "%s/lowmem.c.bin", dir);
+        simple_compress(filename, LOWMEM_BEGIN, LOWMEM_SIZE);
+        snprintf(filename, sizeof(filename), "%s/highmem.c.bin", dir);
+        simple_compress(filename, HIGHMEM_BEGIN, HIGHMEM_SIZE);
+    }
+}
 
-    sprintf(filename, "%s_icount_%ld/regs.txt", name, env->icount);
+// the next delta is relative to image_dir
+static void set_ckpt_parent(CPULoongArchState *env, const char* image_dir) {
+    lsassert(realpath(image_dir, ckpt_parent));
+    ram_dirty_reset(env);
+}
+
+static void write_checkpoint(CPULoongArchState *env, char* dir)
+{
+    FILE *f;
+    char filename[1024];
+
+    if (ckpt_delta && ckpt_parent[0]) {
+        sprintf(filename, "%s/delta.bin", dir);
+        save_delta(filename);
+        save_parent(dir);
+    } else {
+        save_checkpoint_memory(dir);
+    }
+
+    sprintf(filename, "%s/regs.txt", dir);
     f = fopen_nofail(filename, "w");
     fprintf(f, "icount 0x%016lx\n", env->icount);
     loongarch_cpu_dump_state(env, f);
     fclose(f);
+}
+
+void save_checkpoint(CPULoongArchState *env, char* name)
+{
+    char dir[1024];
 
+    make_checkpoint_dir(env, name, dir);
+    write_checkpoint(env, dir);
+
+    if (ckpt_delta) {
+        set_ckpt_parent(env, dir);
+    }
+}
+
+/*
+ * Asynchronous checkpoints, a forked writer saves the image from its
+ * copy-on-write snapshot of ram while emulation goes on. At most
+ * max_writers run at once, each on its share of the host cores, exit waits
+ * for all of them. Ram shared with a file (--memfd, hugetlb) is no snapshot
+ * in the writer, such checkpoints are saved in place.
+ */
+#define CKPT_WRITERS_MAX 64
+static pid_t ckpt_writers[CKPT_WRITERS_MAX];
+static int ckpt_writer_num;
+
+static void reap_checkpoint_writer(int i, int options) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(ckpt_writers[i], &status, options)) < 0) {
+        lsassertm(errno == EINTR, "can not wait checkpoint writer pid:%d, error:%s\n", ckpt_writers[i], strerror(errno));
+    }
+    if (pid == 0) {
+        return;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "ERROR: checkpoint writer pid:%d failed\n", pid);
+    }
+    memmove(ckpt_writers + i, ckpt_writers + i + 1, (-- ckpt_writer_num - i) * sizeof(pid_t));
+}
+
+// reap the finished writers, wait for the oldest if none is
+static void wait_checkpoint_writer(void) {
+    int num = ckpt_writer_num;
+    for (int i = num - 1; i >= 0; i--) {
+        reap_checkpoint_writer(i, WNOHANG);
+    }
+    if (ckpt_writer_num == num) {
+        reap_checkpoint_writer(0, 0);
+    }
+}
+
+static void wait_checkpoint_writers(void) {
+    while (ckpt_writer_num) {
+        wait_checkpoint_writer();
+    }
+}
+
+// a forked clone does not own the writers of its parent
+void ckpt_writers_forget(void) {
+    ckpt_writer_num = 0;
+}
+
+void save_checkpoint_async(CPULoongArchState *env, char* name, int max_writers)
+{
+    char dir[1024];
+    static bool wait_at_exit;
+
+    if (ram_is_shared()) {
+        save_checkpoint(env, name);
+        return;
+    }
+    max_writers = MIN(MAX(max_writers, 1), CKPT_WRITERS_MAX);
+    while (ckpt_writer_num >= max_writers) {
+        wait_checkpoint_writer();
+    }
+    if (!wait_at_exit) {
+        atexit(wait_checkpoint_writers);
+        wait_at_exit = true;
+    }
+    // the writer would not inherit the userfaultfd of a lazy restore
+    ckpt_lazy_finish();
+    make_checkpoint_dir(env, name, dir);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    lsassertm(pid >= 0, "fork failed, error:%s\n", strerror(errno));
+    if (pid == 0) {
+        ckpt_writer_num = 0;
+        host_pool_init(MAX(host_cores() / max_writers, 1));
+        write_checkpoint(env, dir);
+        _exit(EXIT_SUCCESS);
+    }
+    ckpt_writers[ckpt_writer_num ++] = pid;
+
+    if (ckpt_delta) {
+        set_ckpt_parent(env, dir);
+    }
 }
 
 void restore_checkpoint(CPULoongArchState *env, char* image_dir)
@@ -145,10 +1281,7 @@ void restore_checkpoint(CPULoongArchState *env, char* image_dir)
 
     fprintf(stderr, "load ckpt, from directory \"%s\"\n", image_dir);
 
-    sprintf(filename, "%s/lowmem.c.bin", image_dir);
-    simple_decompress(filename, LOWMEM_BEGIN, LOWMEM_SIZE);
-    sprintf(filename, "%s/highmem.c.bin", image_dir);
-    simple_decompress(filename, HIGHMEM_BEGIN, HIGHMEM_SIZE);
+    restore_checkpoint_memory(image_dir);
 
     sprintf(filename, "%s/regs.txt", image_dir);
     FILE *reg_file = fopen_nofail(filename, "r");
@@ -160,8 +1293,44 @@ void restore_checkpoint(CPULoongArchState *env, char* image_dir)
     // if (env->CSR_CNTC < 0) {
     //     env->CSR_CNTC = 0;
     // }
-    env->timer_counter = env->CSR_TVAL;
+    cpu_set_timer_counter(env, env->CSR_TVAL, env->icount - 1);
     env->CSR_TICLR = 0;
+    cpu_dmw_refresh(env);
+    if (ckpt_delta) {
+        set_ckpt_parent(env, image_dir);
+    }
+}
+
+// fold the chain of a delta checkpoint into a standalone one, in place
+void compact_checkpoint(char* image_dir)
+{
+    char filename[PATH_MAX + 16];
+    char parent[PATH_MAX];
+    if (!read_parent(image_dir, parent)) {
+        fprintf(stderr, "%s is already standalone\n", image_dir);
+        return;
+    }
+    restore_checkpoint_memory(image_dir);
+    save_checkpoint_memory(image_dir);
+    snprintf(filename, sizeof(filename), "%s/delta.bin", image_dir);
+    lsassert(unlink(filename) == 0);
+    snprintf(filename, sizeof(filename), "%s/parent", image_dir);
+    lsassert(unlink(filename) == 0);
+    fprintf(stderr, "compacted %s\n", image_dir);
+}
+
+#endif
+
+/*
+ * The -z timer used to tick before every instruction. Plugins save after
+ * the tick of the instruction at icount, the debug cli before it, and TVAL
+ * is saved as it was at that point. Restore ticks it once before the
+ * instruction at icount.
+ */
+static int ckpt_timer_ticked;
+
+static inline int64_t ckpt_timer_counter(CPULoongArchState *env) {
+    return cpu_timer_counter(env, env->icount - 1 + ckpt_timer_ticked);
 }
 
 static uint64_t* get_csr_ptr(CPULoongArchState *env, uint64_t idx) {
@@ -250,6 +1419,8 @@ static void loongarch_cpu_dump_state(CPULoongArchState *env, FILE *f)
         fprintf(f, "\n");
     }
 
+#if !defined(CONFIG_USER_ONLY)
+    // a user mode process has no csr state
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_CRMD, env->CSR_CRMD);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_PRMD, env->CSR_PRMD);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_EUEN, env->CSR_EUEN);
@@ -281,7 +1452,7 @@ static void loongarch_cpu_dump_state(CPULoongArchState *env, FILE *f)
     }
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_TID, env->CSR_TID);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_TCFG, env->CSR_TCFG);
-    fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_TVAL, env->timer_counter);
+    fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_TVAL, ckpt_timer_counter(env));
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_CNTC, env->CSR_CNTC);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_TICLR, 0ul);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_LLBCTL, env->CSR_LLBCTL);
@@ -308,6 +1479,7 @@ static void loongarch_cpu_dump_state(CPULoongArchState *env, FILE *f)
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_DBG, env->CSR_DBG);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_DERA, env->CSR_DERA);
     fprintf(f, "csr 0x%x 0x%016lx\n", LOONGARCH_CSR_DSAVE, env->CSR_DSAVE);
+#endif
 }
 
 static void loongarch_cpu_restore_state(CPULoongArchState *env, FILE* f)
@@ -360,18 +1532,44 @@ static void loongarch_cpu_restore_state(CPULoongArchState *env, FILE* f)
 }
 
 
+#if !defined(CONFIG_USER_ONLY)
 // --------- support qemu format checkpoint save/restore ---------
 
-static uint32_t xorsum32(const uint8_t *data, uint64_t size)
+// the qemu format keeps the xor of 32 bit words
+static uint32_t xorsum_fold32(uint64_t xs)
 {
-    uint32_t sum = 0;
-    uint64_t i;
+    return xs ^ (xs >> 32);
+}
 
-    for (i=0; i<size; i+=4) {
-        sum ^= *(const uint32_t *)(data + i);
+// --ckpt-lazy, map each run of present pages, the data of a page follows the ones before it
+#define LAZY_MAX_MAPS 32768  // well below vm.max_map_count, the rest is read
+static void map_memory_qemu_format(int fd, const uint8_t* page_bmp, uint64_t mem_page_num, uint64_t data_off) {
+    uint64_t low_pages = LOWMEM_SIZE / PAGE_SIZE;
+    uint64_t file_off = data_off;
+    uint64_t maps = 0;
+    for (uint64_t i = 0; i < mem_page_num;) {
+        if (!(page_bmp[i / 8] & (1 << (i % 8)))) {
+            i++;
+            continue;
+        }
+        uint64_t j = i + 1;
+        while (j < mem_page_num && j != low_pages && (page_bmp[j / 8] & (1 << (j % 8)))) {
+            j++;
+        }
+        uint64_t pa = i < low_pages ? LOWMEM_BEGIN + i * PAGE_SIZE : HIGHMEM_BEGIN + (i - low_pages) * PAGE_SIZE;
+        uint64_t size = (j - i) * PAGE_SIZE;
+        if (maps < LAZY_MAX_MAPS) {
+            void* p = mmap(ram + pa, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_off);
+            lsassertm(p != MAP_FAILED, "map checkpoint failed, error:%s\n", strerror(errno));
+            maps ++;
+        } else {
+            lsassert(pread(fd, ram + pa, size, file_off) == size);
+        }
+        ram_set_dirty_range(pa, size);
+        file_off += size;
+        i = j;
     }
-
-    return sum;
+    fprintf(stderr, "lazy restore, %ld runs of pages mapped\n", maps);
 }
 
 static void restore_memory_qemu_format(CPULoongArchState *env, char* mem_path) {
@@ -390,7 +1588,6 @@ static void restore_memory_qemu_format(CPULoongArchState *env, char* mem_path) {
     uint64_t mem_size, page_bmp_size, mem_page_num;
     uint32_t data_off, sum, cal_sum;
     uint8_t *page_bmp;
-    uint8_t* p;
 
     FILE* f = fopen_nofail(mem_path, "rb");
     lsassert(fread(&mem_size, sizeof(mem_size), 1, f) == 1);
@@ -401,29 +1598,44 @@ static void restore_memory_qemu_format(CPULoongArchState *env, char* mem_path) {
     page_bmp = malloc(page_bmp_size);
     lsassert(fread(page_bmp, page_bmp_size, 1, f) == 1);
 
-    fseek(f, data_off, SEEK_SET);
+    if (ckpt_lazy && data_off % PAGE_SIZE == 0) {
+        map_memory_qemu_format(fileno(f), page_bmp, mem_page_num, data_off);
+        fclose(f);
+        free(page_bmp);
+        return;
+    }
 
-    p = (uint8_t*)ram;
-    cal_sum = 0;
-    uint64_t restore_mem_size_bytes = 0;
-    for (int i = 0; i < mem_page_num; i++) {
-        int dirty = page_bmp[i / 8] & (1 << (i % 8));
-        if (dirty) {
-            lsassert(fread(p, PAGE_SIZE, 1, f) == 1);
-        }
-        cal_sum ^= xorsum32(p, PAGE_SIZE);
-        p += PAGE_SIZE;
-        restore_mem_size_bytes += PAGE_SIZE;
-        if (restore_mem_size_bytes == LOWMEM_SIZE) {
-            p = (uint8_t*)ram + HIGHMEM_BEGIN;
+    fclose(f);
+
+    // the pages of low and high memory are copied apart, in parallel
+    int64_t input_size;
+    uint8_t* input_buf = map_file_nofail(mem_path, &input_size);
+    uint64_t* offset = malloc(mem_page_num * sizeof(uint64_t));
+    uint64_t index = data_off;
+    uint64_t low_pages = LOWMEM_SIZE / PAGE_SIZE;
+    for (uint64_t i = 0; i < mem_page_num; i++) {
+        offset[i] = 0;
+        if (page_bmp[i / 8] & (1 << (i % 8))) {
+            lsassertm(index + PAGE_SIZE <= input_size, "%s is truncated\n", mem_path);
+            offset[i] = index;
+            index += PAGE_SIZE;
+            ram_set_dirty(i < low_pages ? i * PAGE_SIZE : HIGHMEM_BEGIN + (i - low_pages) * PAGE_SIZE);
         }
     }
+    CopyRange low = { .base = 0, .input = input_buf, .offset = offset };
+    CopyRange high = { .base = HIGHMEM_BEGIN, .input = input_buf, .offset = offset + low_pages };
+    PageJob low_job = { .fn = copy_pages, .opaque = &low, .page_num = MIN(low_pages, mem_page_num) };
+    PageJob high_job = { .fn = copy_pages, .opaque = &high, .page_num = mem_page_num - low_job.page_num };
+    uint64_t xs = run_page_job(&low_job) ^ run_page_job(&high_job);
+    cal_sum = xorsum_fold32(xs);
+    munmap(input_buf, input_size);
+    free(offset);
+
     if (sum != cal_sum) {
         fprintf(stderr, "warn:xorsum mismatch (restored: %08x original: %08x)\n", cal_sum, sum);
     }
     // lsassertm(sum == cal_sum, "xorsum mismatch (restored: %08x original: %08x)\n", cal_sum, sum);
 
-    fclose(f);
     free(page_bmp);
 }
 
@@ -460,25 +1672,20 @@ static void save_memory_qemu_format(CPULoongArchState *env, char* mem_path) {
 
     fseek(f, data_off, SEEK_SET);
     lsassert((LOWMEM_SIZE % PAGE_SIZE) == 0);
-    for (uint64_t addr = 0; addr < LOWMEM_SIZE; addr += PAGE_SIZE) {
-        int dirty = memcmp(ram_ptr + addr, zero4k, PAGE_SIZE);
-        if (dirty) {
-            uint64_t page = addr / PAGE_SIZE;
+    // a page that was never written is zero and adds nothing to the sum
+    uint64_t low_pages = LOWMEM_SIZE / PAGE_SIZE;
+    uint8_t* present = malloc(mem_page_num);
+    uint64_t xs = scan_ram(0, LOWMEM_SIZE, present) ^
+                  scan_ram(HIGHMEM_BEGIN, mem_size - LOWMEM_SIZE, present + low_pages);
+    sum = xorsum_fold32(xs);
+    for (uint64_t page = 0; page < mem_page_num; page++) {
+        if (present[page]) {
+            uint64_t addr = page < low_pages ? page * PAGE_SIZE : HIGHMEM_BEGIN + (page - low_pages) * PAGE_SIZE;
             page_bmp[page / 8] |= 1 << (page % 8);
             lsassert(fwrite(ram_ptr + addr, PAGE_SIZE, 1, f) == 1);
         }
-        sum ^= xorsum32(ram_ptr + addr, PAGE_SIZE);
-    }
-
-    for (uint64_t addr = HIGHMEM_BEGIN; addr < (HIGHMEM_BEGIN + mem_size - LOWMEM_SIZE); addr += PAGE_SIZE) {
-        int dirty = memcmp(ram_ptr + addr, zero4k, PAGE_SIZE);
-        if (dirty) {
-            uint64_t page = (addr - HIGHMEM_BEGIN + LOWMEM_SIZE) / PAGE_SIZE;
-            page_bmp[page / 8] |= 1 << (page % 8);
-            lsassert(fwrite(ram_ptr + addr, PAGE_SIZE, 1, f) == 1);
-        }
-        sum ^= xorsum32(ram_ptr + addr, PAGE_SIZE);
     }
+    free(present);
 
     fseek(f, 0, SEEK_SET);
     fwrite(&mem_size, sizeof(mem_size), 1, f);
@@ -681,7 +1888,7 @@ static void save_cpu_qemu_format(CPULoongArchState *env, char* cpu_path) {
     PRINT_CSR(CSR_TID);
     PRINT_CSR(CSR_TCFG);
     fprintf(f, ".dword  0x%016" PRIx64 " # CSR_TVAL 0x%x\n", \
-                env->timer_counter , 8*idx++);
+                ckpt_timer_counter(env), 8*idx++);
     PRINT_CSR(CSR_CNTC);
     fprintf(f, ".dword  0x%016" PRIx64 " # CSR_TICLR 0x%x\n", \
                 0ul , 8*idx++);
@@ -738,8 +1945,9 @@ void restore_checkpoint_qemu_format(CPULoongArchState *env, char* mem_path, char
     // if (env->CSR_CNTC < 0) {
     //     env->CSR_CNTC = 0;
     // }
-    env->timer_counter = env->CSR_TVAL;
+    cpu_set_timer_counter(env, env->CSR_TVAL, env->icount - 1);
     env->CSR_TICLR = 0;
+    cpu_dmw_refresh(env);
 }
 
 void save_checkpoint_qemu_format(CPULoongArchState *env, char* name) {
@@ -761,12 +1969,427 @@ void save_checkpoint_qemu_format(CPULoongArchState *env, char* name) {
 }
 
 #else
+/*
+ * User mode checkpoints. Guest addresses are host addresses, so the image
+ * is the guest regions tracked by syscall.c with their pages that are not
+ * zero, plus the brk, the cwd and the files the guest opened:
+ *
+ *   regs.txt    registers, as in a kernel mode checkpoint
+ *   layout.txt  exec path, cwd, brk, regions and fds, one per line
+ *   mem.bin     header, runs of saved pages, the pages from data_off
+ *
+ * A region mapped from a file is restored as anonymous memory with its
+ * pages, the guest sees no difference for a private mapping. Pages past the
+ * end of the file are not saved, they raise SIGBUS when read and come back
+ * as zero.
+ */
+#define USER_MAGIC "LAEMUUS1"
+
+#ifndef MAP_FIXED_NOREPLACE
+// only a hint then, a region taken by the host is still caught
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+typedef struct UserHeader {
+    char magic[8];
+    uint64_t run_num;
+    uint64_t page_num;
+    uint64_t xor_sum;
+} UserHeader;
+
+// page_num pages of the guest at va, in mem.bin at offset
+typedef struct UserRun {
+    uint64_t va;
+    uint64_t page_num;
+    uint64_t offset;
+} UserRun;
+
+// pagemap bits of a page that is mapped or swapped out
+#define PAGEMAP_PRESENT (1ull << 63)
+#define PAGEMAP_SWAP (1ull << 62)
+
+typedef struct UserScan {
+    uint64_t start;
+    uint8_t* present;
+    const uint64_t* pagemap;
+    const uint8_t* readable; // NULL for an anonymous region
+    uint64_t host_page;
+} UserScan;
+
+static uint64_t user_scan_pages(PageJob* job, uint64_t begin, uint64_t end) {
+    UserScan* r = job->opaque;
+    uint64_t xs = 0;
+    for (uint64_t i = begin; i < end; i++) {
+        // an anonymous page never touched is zero, leave it unread, an
+        // untouched page of a file is read if the file backs it. The
+        // pagemap starts at the host page holding start
+        uint64_t host_index = (r->start + i * __4KB) / r->host_page - r->start / r->host_page;
+        bool touched = (r->pagemap[host_index] & (PAGEMAP_PRESENT | PAGEMAP_SWAP)) ||
+                       (r->readable && r->readable[i]);
+        r->present[i] = touched && page_scan((void*)(r->start + i * __4KB), &xs);
+    }
+    return xs;
+}
+
+/*
+ * 4K pages of [start, end) backed by anonymous memory or by their file, from
+ * the host mappings in /proc/self/maps. A file that is gone or replaced
+ * backs nothing, only its pages in the pagemap are saved then.
+ */
+static uint8_t* read_backed_pages(uint64_t start, uint64_t end) {
+    uint64_t host_page = getpagesize();
+    uint8_t* readable = calloc((end - start) / __4KB, 1);
+    FILE* f = fopen_nofail("/proc/self/maps", "r");
+    char* line = NULL;
+    size_t cap = 0;
+    lsassert(readable);
+    while (getline(&line, &cap, f) > 0) {
+        uint64_t lo, hi, offset, inode;
+        int path = 0;
+        if (sscanf(line, "%lx-%lx %*s %lx %*s %lu %n", &lo, &hi, &offset, &inode, &path) < 4 ||
+            hi <= start || lo >= end) {
+            continue;
+        }
+        uint64_t valid = hi;
+        if (inode) {
+            struct stat st;
+            line[strcspn(line, "\n")] = '\0';
+            valid = lo;
+            if (stat(line + path, &st) == 0 && st.st_ino == inode && st.st_size > offset) {
+                valid = MIN(hi, lo + ROUND_UP(st.st_size - offset, host_page));
+            }
+        }
+        for (uint64_t va = MAX(lo, start); va < MIN(valid, end); va += __4KB) {
+            readable[(va - start) / __4KB] = 1;
+        }
+    }
+    free(line);
+    fclose(f);
+    return readable;
+}
+
+// entries of the host pages that [start, start + size) touches
+static uint64_t* read_pagemap(int fd, uint64_t start, uint64_t size) {
+    uint64_t host_page = getpagesize();
+    uint64_t n = DIV_ROUND_UP(start + size, host_page) - start / host_page;
+    uint64_t* pagemap = malloc(n * sizeof(uint64_t));
+    uint64_t done = 0;
+    while (done < n * sizeof(uint64_t)) {
+        ssize_t r = pread(fd, (char*)pagemap + done, n * sizeof(uint64_t) - done,
+                          start / host_page * sizeof(uint64_t) + done);
+        lsassertm(r > 0, "read pagemap failed, error:%s\n", strerror(errno));
+        done += r;
+    }
+    return pagemap;
+}
+
+static void save_user_memory(const char* filename) {
+    UserHeader h = { .magic = USER_MAGIC };
+    UserRun* runs = NULL;
+    uint64_t run_cap = 0;
+    int pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    lsassertm(pagemap_fd >= 0, "open /proc/self/pagemap failed, error:%s\n", strerror(errno));
+
+    for (int k = 0; k < guest_region_num; k++) {
+        GuestRegion* g = &guest_regions[k];
+        if (!(g->prot & PROT_READ)) {
+            continue;
+        }
+        uint64_t size = g->end - g->start;
+        UserScan r = {
+            .start = g->start,
+            .present = malloc(size / __4KB),
+            .pagemap = read_pagemap(pagemap_fd, g->start, size),
+            .readable = g->anon ? NULL : read_backed_pages(g->start, g->end),
+            .host_page = getpagesize(),
+        };
+        PageJob job = { .fn = user_scan_pages, .opaque = &r, .page_num = size / __4KB };
+        h.xor_sum ^= run_page_job(&job);
+        for (uint64_t i = 0; i < job.page_num; i++) {
+            if (!r.present[i]) {
+                continue;
+            }
+            uint64_t va = g->start + i * __4KB;
+            UserRun* last = h.run_num ? &runs[h.run_num - 1] : NULL;
+            if (last && last->va + last->page_num * __4KB == va) {
+                last->page_num++;
+            } else {
+                if (h.run_num == run_cap) {
+                    run_cap = MAX(run_cap * 2, 64);
+                    runs = realloc(runs, run_cap * sizeof(UserRun));
+                    lsassert(runs);
+                }
+                runs[h.run_num++] = (UserRun){ .va = va, .page_num = 1, .offset = h.page_num * __4KB };
+            }
+            h.page_num++;
+        }
+        free(r.present);
+        free((void*)r.pagemap);
+        free((void*)r.readable);
+    }
+    close(pagemap_fd);
+
+    uint64_t data_off = ROUND_UP(sizeof(h) + h.run_num * sizeof(UserRun), __4KB);
+    for (uint64_t i = 0; i < h.run_num; i++) {
+        runs[i].offset += data_off;
+    }
+    FILE* f = fopen_nofail(filename, "wb");
+    lsassert(fwrite(&h, sizeof(h), 1, f) == 1);
+    lsassert(fwrite(runs, sizeof(UserRun), h.run_num, f) == h.run_num);
+    lsassert(fseek(f, data_off, SEEK_SET) == 0);
+    for (uint64_t i = 0; i < h.run_num; i++) {
+        lsassert(fwrite((void*)runs[i].va, __4KB, runs[i].page_num, f) == runs[i].page_num);
+    }
+    fclose(f);
+    free(runs);
+}
+
+typedef struct UserImage {
+    const uint8_t* input;
+    const UserRun* runs;
+    uint64_t run_num;
+    uint64_t data_off;
+} UserImage;
+
+static uint64_t user_copy_pages(PageJob* job, uint64_t begin, uint64_t end) {
+    UserImage* m = job->opaque;
+    uint64_t offset = m->data_off + begin * __4KB;
+    uint64_t lo = 0, hi = m->run_num - 1;
+    // the run holding page begin, the last one starting at or before it
+    while (lo < hi) {
+        uint64_t mid = (lo + hi + 1) / 2;
+        if (m->runs[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    const UserRun* r = &m->runs[lo];
+    uint64_t xs = 0;
+    for (uint64_t i = begin; i < end; i++, offset += __4KB) {
+        if (offset == r->offset + r->page_num * __4KB) {
+            r++;
+        }
+        xs ^= page_copy((void*)(r->va + offset - r->offset), m->input + offset);
+    }
+    return xs;
+}
+
+static void restore_user_memory(const char* filename) {
+    int64_t input_size;
+    uint8_t* input_buf = map_file_nofail(filename, &input_size);
+    UserHeader* h = (UserHeader*)input_buf;
+    lsassertm(input_size >= sizeof(*h) && memcmp(h->magic, USER_MAGIC, 8) == 0,
+              "%s is not a user mode checkpoint\n", filename);
+    UserImage m = {
+        .input = input_buf,
+        .runs = (UserRun*)(h + 1),
+        .run_num = h->run_num,
+        .data_off = ROUND_UP(sizeof(*h) + h->run_num * sizeof(UserRun), __4KB),
+    };
+    lsassertm(m.data_off + h->page_num * __4KB <= input_size, "%s is truncated\n", filename);
+    PageJob job = { .fn = user_copy_pages, .opaque = &m, .page_num = h->page_num };
+    uint64_t xs = run_page_job(&job);
+    lsassertm(xs == h->xor_sum, "xorsum mismatch (restored: %lx original: %lx)\n", xs, h->xor_sum);
+    munmap(input_buf, input_size);
+}
+
+static void save_user_layout(const char* filename) {
+    FILE* f = fopen_nofail(filename, "w");
+    char path[PATH_MAX];
+    abi_ulong brk, initial_brk;
+
+    fprintf(f, "exec %s\n", exec_path);
+    lsassert(getcwd(path, sizeof(path)));
+    fprintf(f, "cwd %s\n", path);
+    target_get_brk(&brk, &initial_brk);
+    fprintf(f, "brk 0x%lx 0x%lx\n", brk, initial_brk);
+    for (int i = 0; i < guest_region_num; i++) {
+        GuestRegion* g = &guest_regions[i];
+        fprintf(f, "region 0x%lx 0x%lx 0x%x %d\n", g->start, g->end, g->prot, g->anon);
+    }
+    for (int fd = 0; fd < GUEST_FD_MAX; fd++) {
+        char link[64];
+        if (!test_bit(fd, guest_fds)) {
+            continue;
+        }
+        sprintf(link, "/proc/self/fd/%d", fd);
+        ssize_t n = readlink(link, path, sizeof(path) - 1);
+        if (n < 0) {
+            continue;
+        }
+        path[n] = 0;
+        fprintf(f, "fd %d 0x%x 0x%lx %s\n", fd, fcntl(fd, F_GETFL), lseek(fd, 0, SEEK_CUR), path);
+    }
+    fclose(f);
+}
+
+/*
+ * Map the guest regions of a checkpoint PROT_NONE before the host allocates
+ * more memory, restore_user_region maps over them. A region the host
+ * already uses is reported, the checkpoint can not be restored then.
+ */
+void reserve_user_regions(const char* image_dir) {
+    char filename[PATH_MAX + 16];
+    char line[PATH_MAX + 64];
+    int taken = 0;
+    snprintf(filename, sizeof(filename), "%s/layout.txt", image_dir);
+    FILE* f = fopen_nofail(filename, "r");
+    while (fgets(line, sizeof(line), f)) {
+        abi_ulong start, end;
+        int prot, anon;
+        if (sscanf(line, "region 0x%lx 0x%lx 0x%x %d", &start, &end, &prot, &anon) != 4) {
+            continue;
+        }
+        void* p = mmap((void*)start, end - start, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p != (void*)start) {
+            fprintf(stderr, "guest region %lx-%lx is taken by the host\n", start, end);
+            if (p != MAP_FAILED) {
+                munmap(p, end - start);
+            }
+            taken++;
+        }
+    }
+    fclose(f);
+    if (taken) {
+        fprintf(stderr, "can not restore %s, %d guest regions overlap the host\n", image_dir, taken);
+        laemu_exit(EXIT_FAILURE);
+    }
+}
+
+static void restore_user_region(abi_ulong start, abi_ulong end, int prot, bool anon) {
+    // writable until the pages are in, see protect_user_regions
+    int map_prot = prot == PROT_NONE ? PROT_NONE : PROT_READ | PROT_WRITE;
+    void* p = mmap((void*)start, end - start, map_prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    lsassertm(p == (void*)start, "map guest region %lx-%lx failed, error:%s\n", start, end, strerror(errno));
+    guest_region_add(start, end - start, prot, anon);
+}
+
+static void protect_user_regions(void) {
+    for (int i = 0; i < guest_region_num; i++) {
+        GuestRegion* g = &guest_regions[i];
+        if (g->prot != PROT_NONE && g->prot != (PROT_READ | PROT_WRITE)) {
+            lsassert(mprotect((void*)g->start, g->end - g->start, g->prot) == 0);
+        }
+    }
+}
+
+static void restore_user_fd(int fd, int flags, off_t offset, const char* path) {
+    if (path[0] != '/') {
+        fprintf(stderr, "warn: fd %d is %s, not a file, left closed\n", fd, path);
+        return;
+    }
+    int new_fd = open(path, flags);
+    if (new_fd < 0) {
+        fprintf(stderr, "warn: cannot reopen fd %d %s, error:%s\n", fd, path, strerror(errno));
+        return;
+    }
+    if (new_fd != fd) {
+        // an fd already open here is replaced, as the guest had it
+        lsassert(dup2(new_fd, fd) == fd);
+        close(new_fd);
+    }
+    if (offset != -1) {
+        lseek(fd, offset, SEEK_SET);
+    }
+    set_bit(fd, guest_fds);
+}
+
+typedef struct UserFd {
+    int fd;
+    int flags;
+    long offset;
+    char path[PATH_MAX];
+} UserFd;
+
+static void restore_user_layout(const char* filename) {
+    FILE* f = fopen_nofail(filename, "r");
+    char line[PATH_MAX + 64];
+    UserFd* fds = NULL;
+    int fd_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        abi_ulong a, b;
+        int prot, anon;
+        UserFd u;
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "exec ", 5) == 0) {
+            exec_path = strdup(line + 5);
+        } else if (strncmp(line, "cwd ", 4) == 0) {
+            if (chdir(line + 4) < 0) {
+                fprintf(stderr, "warn: cannot chdir to %s, error:%s\n", line + 4, strerror(errno));
+            }
+        } else if (sscanf(line, "brk 0x%lx 0x%lx", &a, &b) == 2) {
+            target_restore_brk(a, b);
+        } else if (sscanf(line, "region 0x%lx 0x%lx 0x%x %d", &a, &b, &prot, &anon) == 4) {
+            restore_user_region(a, b, prot, anon);
+        } else if (sscanf(line, "fd %d 0x%x 0x%lx %[^\n]", &u.fd, &u.flags, &u.offset, u.path) == 4) {
+            fds = realloc(fds, (fd_num + 1) * sizeof(UserFd));
+            fds[fd_num++] = u;
+        } else {
+            lsassertm(false, "Unknown layout line, check %s: %s\n", filename, line);
+        }
+    }
+    fclose(f);
+    // the fd of layout.txt may be one of them
+    for (int i = 0; i < fd_num; i++) {
+        restore_user_fd(fds[i].fd, fds[i].flags, fds[i].offset, fds[i].path);
+    }
+    free(fds);
+}
+
 void save_checkpoint(CPULoongArchState *env, char* name) {
-    fprintf(stderr, "error :can not save checkpoint in user mode\n");
+    char dir[1024];
+    char filename[1024];
+
+    make_checkpoint_dir(env, name, dir);
+
+    sprintf(filename, "%s/mem.bin", dir);
+    save_user_memory(filename);
+    sprintf(filename, "%s/layout.txt", dir);
+    save_user_layout(filename);
+
+    sprintf(filename, "%s/regs.txt", dir);
+    FILE* f = fopen_nofail(filename, "w");
+    fprintf(f, "icount 0x%016lx\n", env->icount);
+    loongarch_cpu_dump_state(env, f);
+    fclose(f);
 }
 
-void restore_checkpoint(CPULoongArchState *env, char* name) {
-    lsassertm(false, "can not restore checkpoint in user mode\n");
+void restore_checkpoint(CPULoongArchState *env, char* image_dir) {
+    char filename[1024];
+    char buffer[1024];
+
+    fprintf(stderr, "load ckpt, from directory \"%s\"\n", image_dir);
+
+    sprintf(filename, "%s/layout.txt", image_dir);
+    restore_user_layout(filename);
+    sprintf(filename, "%s/mem.bin", image_dir);
+    restore_user_memory(filename);
+    protect_user_regions();
+
+    sprintf(filename, "%s/regs.txt", image_dir);
+    FILE *reg_file = fopen_nofail(filename, "r");
+    lsassert(fgets(buffer, sizeof(buffer), reg_file));
+    lsassert(sscanf(buffer, "icount 0x%lx", &env->icount) == 1);
+    printf("restore from icount=%ld\n", env->icount);
+    loongarch_cpu_restore_state(env, reg_file);
+    fclose(reg_file);
+}
+
+// a user mode image is small, it is written in place
+void save_checkpoint_async(CPULoongArchState *env, char* name, int max_writers) {
+    save_checkpoint(env, name);
+}
+
+void compact_checkpoint(char* image_dir) {
+    lsassertm(false, "can not compact checkpoint in user mode\n");
+}
+
+void ckpt_lazy_finish(void) {
+}
+
+void ckpt_writers_forget(void) {
 }
 
 void save_checkpoint_qemu_format(CPULoongArchState *env, char* name) {
@@ -780,5 +2403,21 @@ void restore_checkpoint_qemu_format(CPULoongArchState *env, char* mem_path, char
 
 // export save_checkpoint to dynamic library
 void la_emu_save_checkpoint(void *env, char* name) {
+    ckpt_timer_ticked = 1;
     save_checkpoint((CPULoongArchState*)env, name);
+    ckpt_timer_ticked = 0;
+}
+
+void la_emu_save_checkpoint_async(void *env, char* name, int max_writers) {
+    ckpt_timer_ticked = 1;
+    save_checkpoint_async((CPULoongArchState*)env, name, max_writers);
+    ckpt_timer_ticked = 0;
+}
+
+int la_emu_checkpoint_can_fork(void) {
+#if !defined(CONFIG_USER_ONLY)
+    return !ram_is_shared();
+#else
+    return 1;
+#endif
 }
\ No newline at end of file
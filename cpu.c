@@ -2,6 +2,7 @@
 #include "cpu.h"
 #include "internals.h"
 #include "cpu-csr.h"
+#include "mmio.h"
 #include <stdio.h>
 
 const char * const regnames[32] = {
@@ -125,6 +126,8 @@ void perf_report_plv(CPULoongArchState *env, FILE* f, int plv, char* plv_name) {
     fprintf(f, "%s, COUNTER_INST_LASX:             %20lu\n", plv_name, env->perf_counter[plv][COUNTER_INST_LASX]);
     fprintf(f, "%s, COUNTER_INST_CROSS_PAGE_LOAD:  %20lu\n", plv_name, env->perf_counter[plv][COUNTER_INST_CROSS_PAGE_LOAD]);
     fprintf(f, "%s, COUNTER_INST_CROSS_PAGE_STORE: %20lu\n", plv_name, env->perf_counter[plv][COUNTER_INST_CROSS_PAGE_STORE]);
+    fprintf(f, "%s, COUNTER_INST_MISALIGNED_LOAD:  %20lu\n", plv_name, env->perf_counter[plv][COUNTER_INST_MISALIGNED_LOAD]);
+    fprintf(f, "%s, COUNTER_INST_MISALIGNED_STORE: %20lu\n", plv_name, env->perf_counter[plv][COUNTER_INST_MISALIGNED_STORE]);
 
 }
 void perf_report(CPULoongArchState *env, FILE* f) {
@@ -139,6 +142,21 @@ void perf_report(CPULoongArchState *env, FILE* f) {
 
 void dump_exec_info(CPULoongArchState *env, FILE* f) {
     fprintf(f, "icount:%ld ic_hit_count:%ld syscall_count:%ld ecount:%ld tlbr:%ld irq:%ld\n", env->icount, env->ic_hit_count, env->syscall_count, env->ecount, env->tlbr_count, env->irq_count);
+    fprintf(f, "tb_hit:%ld tb_miss:%ld\n", env->tb_hit_count, env->tb_miss_count);
+#if !defined(CONFIG_USER_ONLY)
+    fprintf(f, "tc_hit:%ld tc_miss:%ld tc_flush:%ld tc_flush_avoided:%ld dmw_hit:%ld\n", env->tc_hit_count, env->tc_miss_count, env->tc_flush_count, env->tc_flush_avoided, env->dmw_hit_count);
+    fprintf(f, "pwc_hit:%ld pwc_miss:%ld pwc_flush:%ld\n", env->pwc_hit_count, env->pwc_miss_count, env->pwc_flush_count);
+    // larger pages hit in tc_huge once per TARGET_PAGE_SIZE page, later hits count in the tc
+    for (int ps = TARGET_PAGE_BITS; ps < 64; ps++) {
+        if (env->tc_ps_fill[ps]) {
+            fprintf(f, "tc_ps%d: hit:%ld fill:%ld\n", ps, ps == TARGET_PAGE_BITS ? env->tc_hit_count : env->tc_ps_hit[ps], env->tc_ps_fill[ps]);
+        }
+    }
+    mmio_report(f);
+#endif
+#ifdef CONFIG_JIT
+    fprintf(f, "jit_block:%ld jit_flush:%ld\n", env->jit_block_count, env->jit_flush_count);
+#endif
 #if !defined(CONFIG_USER_ONLY)
     fprintf(f, "PIL:  %10lu ", env->ecounter[EXCCODE_PIL]);
     fprintf(f, "PIS:  %10lu ", env->ecounter[EXCCODE_PIS]);
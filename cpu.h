@@ -32,19 +32,41 @@
 #define CONSTANT_TIMER_ENABLE       0x1UL
 
 typedef struct TLBCache {
-    uint64_t va;
+    uint64_t va;        // page address | TC_FLAG_*
+    uint64_t tag;       // cpu_tc_tag() when filled
     uint64_t pa;
+    uintptr_t addend;   // host address = va + addend
 } TLBCache;
 
-#define TC_BITS 8
-#define TC_NUM (1 << 8)
-#define TC_MASK (((target_long)1 << TC_BITS) - 1)
-#define TC_INDEX(va) ((va >> TARGET_PAGE_BITS) & TC_MASK)
+// low bits of TLBCache.va, such a page never hits the host fast path
+#define TC_FLAG_MMIO        (1ul << 0)  // io or a hole in ram
+#define TC_FLAG_NOTDIRTY    (1ul << 1)
+#define TC_FLAGS            (TC_FLAG_MMIO | TC_FLAG_NOTDIRTY)
+
+// soft tlb size and associativity, --tlbc entries,ways
+#define TC_NUM 256
+#define TC_WAYS 1
+// tag: the CRMD bits the translation depends on, ASID and a generation
+#define TC_CRMD_MASK (R_CSR_CRMD_PLV_MASK | R_CSR_CRMD_DA_MASK | R_CSR_CRMD_PG_MASK)
+#define TC_ASID_SHIFT 5
+#define TC_GEN_SHIFT 15
+
+// pages of at least TC_HUGE_MIN_BITS are cached whole, per access type
+typedef struct TLBCacheHuge {
+    uint64_t va;        // page address
+    uint64_t mask;      // ~(page size - 1)
+    uint64_t tag;
+    uint64_t pa;
+} TLBCacheHuge;
+
+#define TC_HUGE_NUM 8
+#define TC_HUGE_MIN_BITS 21
 
 typedef struct INSCache {
     bool (*trans_func)(void*, void*);
     int arg[4];
     int insn;
+    int op;
 } INSCache;
 
 #define IC_BITS 14
@@ -52,6 +74,24 @@ typedef struct INSCache {
 #define IC_MASK (((target_long)1 << IC_BITS) - 1)
 #define IC_INDEX(va) ((va >> 2) & IC_MASK)
 
+/* pre-decoded guest basic block, keyed by pc and physical address of pc */
+#define TB_MAX_INSNS 32
+typedef struct TBCache {
+    uint64_t pc;
+    uint64_t pa;
+    int n;
+#ifdef CONFIG_JIT
+    int exec_count;
+    void* jit_code;
+#endif
+    INSCache insns[TB_MAX_INSNS];
+} TBCache;
+
+#define TB_BITS 12
+#define TB_NUM (1 << TB_BITS)
+#define TB_MASK (((target_long)1 << TB_BITS) - 1)
+#define TB_INDEX(va) ((va >> 2) & TB_MASK)
+
 
 typedef struct CPUNegativeOffsetState {
     char dummp[25];
@@ -397,6 +437,46 @@ struct LoongArchTLB {
 };
 typedef struct LoongArchTLB LoongArchTLB;
 
+/*
+ * Side indexes of tlb[], kept by tlb_helper.c. Valid entries are on the
+ * global list when tlb_entry0.G is set, else on the list of their asid.
+ * Valid MTLB entries are also hashed by their vpn and page size. Valid STLB
+ * entries are counted by the STLBPS they were filled under, or as strays
+ * when they are not in the set their vpn indexes (tlbwr picks the set).
+ * Lists link tlb[] indexes, -1 ends a list.
+ */
+typedef struct LoongArchTLBIndex {
+    int16_t next[LOONGARCH_TLB_MAX];
+    int16_t prev[LOONGARCH_TLB_MAX];
+    int16_t asid_head[R_CSR_ASID_ASID_MASK + 1];
+    int16_t g_head;
+    int8_t mtlb_head[LOONGARCH_MTLB];   // mtlb entry, tlb[LOONGARCH_STLB + i]
+    int8_t mtlb_next[LOONGARCH_MTLB];
+    uint8_t mtlb_ps_count[64];          // valid mtlb entries per page size
+    uint64_t mtlb_ps_mask;
+    uint8_t stlb_ps[LOONGARCH_STLB];    // STLBPS of a valid stlb entry, or STLB_STRAY
+    uint16_t stlb_ps_count[64];
+    uint64_t stlb_ps_mask;
+    uint16_t stlb_stray;
+} LoongArchTLBIndex;
+
+#define STLB_STRAY 0xff
+
+static inline int loongarch_mtlb_hash(uint64_t vpn, int ps) {
+    return (vpn ^ (vpn >> 6) ^ ps) & (LOONGARCH_MTLB - 1);
+}
+
+// page walk cache of the hardware ptw, upper level directory entries
+#define PWC_NUM 256
+#define PWC_ASID_SHIFT 3
+#define PWC_GEN_SHIFT 13
+typedef struct PWCache {
+    uint64_t pgd;
+    uint64_t prefix;    // va >> dir_base of the level
+    uint64_t tag;       // pwc_gen | asid | level, 0 when empty
+    uint64_t entry;     // helper_lddir() result
+} PWCache;
+
 typedef struct CPUArchState {
     uint64_t gpr[32];
     uint64_t pc;
@@ -477,19 +557,45 @@ typedef struct CPUArchState {
 
 #ifndef CONFIG_USER_ONLY
     LoongArchTLB  tlb[LOONGARCH_TLB_MAX];
+    LoongArchTLBIndex tlb_index;
+    PWCache pwc[PWC_NUM];
+    uint64_t pwc_gen;
+    uint64_t pwc_hit_count;
+    uint64_t pwc_miss_count;
+    uint64_t pwc_flush_count;
+    TLBCacheHuge tc_huge[3][TC_HUGE_NUM];   // indexed by MMUAccessType
+    uint8_t tc_huge_next[3];
+    uint8_t mmu_ps;                 // page size bits of the last translation
+    uint64_t tc_ps_hit[64];
+    uint64_t tc_ps_fill[64];
     bool load_elf;
     uint64_t elf_address;
 #endif
 
     // struct CPUArchState* env;
-    TLBCache tc_load[TC_NUM];
-    TLBCache tc_store[TC_NUM];
-    TLBCache tc_fetch[TC_NUM];
+    TLBCache* tc_load;
+    TLBCache* tc_store;
+    TLBCache* tc_fetch;
+    uint64_t tc_gen;
+    uint64_t tc_flush_count;
+    uint64_t tc_flush_avoided;  // invalidations that dropped only some entries
+    uint64_t tc_hit_count;
+    uint64_t tc_miss_count;
+    uint16_t dmw_mask;      // bit n set: va[63:60] == n is direct mapped at the current plv
+    uint64_t dmw_pa_mask;
+    uint64_t dmw_hit_count;
     INSCache inscache[IC_NUM];
+    TBCache* tbcache;
     uint64_t icount;
     uint64_t ecount;
     uint64_t syscall_count;
     uint64_t ic_hit_count;
+    uint64_t tb_hit_count;
+    uint64_t tb_miss_count;
+#ifdef CONFIG_JIT
+    uint64_t jit_block_count;
+    uint64_t jit_flush_count;
+#endif
     uint64_t ecounter[0x100];
     uint64_t tlbr_count;
     uint64_t irq_count;
@@ -508,7 +614,9 @@ typedef struct CPUArchState {
 #define COUNTER_INST_STORE                 11
 #define COUNTER_INST_CROSS_PAGE_LOAD       12
 #define COUNTER_INST_CROSS_PAGE_STORE      13
-#define COUNTER_INST                       14
+#define COUNTER_INST_MISALIGNED_LOAD       14  // not size aligned, crossing a page or not
+#define COUNTER_INST_MISALIGNED_STORE      15
+#define COUNTER_INST                       16
 
 #define COUNTER_MAX 0x100
 
@@ -520,8 +628,13 @@ typedef struct CPUArchState {
 #define PERF_INC(event) ;
 #endif
     int64_t timer_counter;
+    // -z: icount timer_counter is relative to, and icount at which it reaches 0
+    uint64_t timer_base;
+    uint64_t timer_deadline;
     timer_t timerid;
     volatile sig_atomic_t timer_int;
+    // something may have made an interrupt deliverable, see exec_env
+    volatile sig_atomic_t irq_pending;
 } CPULoongArchState;
 
 typedef CPULoongArchState CPUArchState;
@@ -663,6 +776,10 @@ int probe_get_physical_address(CPULoongArchState *env, hwaddr *physical,
                                 int *prot, target_ulong address,
                                 MMUAccessType access_type);
 bool interpreter(CPULoongArchState *env, uint32_t insn, INSCache* ic);
+bool interpreter_decode(CPULoongArchState *env, uint32_t insn, INSCache* ic);
+#ifdef CONFIG_THREADED
+int interpreter_exec_tb(CPULoongArchState *env, INSCache* ic, int n, hwaddr pa);
+#endif
 
 #ifdef CONFIG_USER_ONLY
 static inline uint64_t ram_ldb(hwaddr addr) {return (int64_t)*(int8_t*)(addr);}
@@ -679,6 +796,9 @@ static inline void ram_stb(hwaddr addr, uint64_t data) {*(uint8_t*)(addr) = data
 static inline void ram_sth(hwaddr addr, uint64_t data) {*(uint16_t*)(addr) = data;}
 static inline void ram_stw(hwaddr addr, uint64_t data) {*(uint32_t*)(addr) = data;}
 static inline void ram_std(hwaddr addr, uint64_t data) {*(uint64_t*)(addr) = data;}
+static inline void* ram_host(hwaddr addr) {return (void*)(addr);}
+// no dirty tracking of the host address space
+static inline void ram_set_dirty(hwaddr addr) {}
 // static inline void ram_st128(hwaddr addr, Int128 data) {*(Int128*)(addr) = data;}
 // static inline void ram_st256(hwaddr addr, VReg data) {*(VReg*)(addr) = data;}
 #else
@@ -697,9 +817,42 @@ static inline void ram_stb(hwaddr addr, uint64_t data) {*(uint8_t*)(ram + addr)
 static inline void ram_sth(hwaddr addr, uint64_t data) {*(uint16_t*)(ram + addr) = data;}
 static inline void ram_stw(hwaddr addr, uint64_t data) {*(uint32_t*)(ram + addr) = data;}
 static inline void ram_std(hwaddr addr, uint64_t data) {*(uint64_t*)(ram + addr) = data;}
+static inline void* ram_host(hwaddr addr) {return ram + addr;}
 // static inline void ram_st128(hwaddr addr, Int128 data) {*(Int128*)(ram + addr) = data;}
 // static inline void ram_st256(hwaddr addr, VReg data) {*(VReg*)(ram + addr) = data;}
 bool addr_in_ram(hwaddr pa);
+bool addr_range_in_ram(hwaddr begin, hwaddr end);
+// ram is a MAP_SHARED mapping of a file, fork does not snapshot it
+bool ram_is_shared(void);
+
+/*
+ * One bit per TARGET_PAGE_SIZE page of [0, ram_pages << TARGET_PAGE_BITS).
+ * ram_dirty: written since the last ram_dirty_reset(), the store tc keeps
+ * TC_FLAG_NOTDIRTY on a clean page so its first write takes store_pa.
+ * ram_used: ever written, any other page is still zero. A superset of
+ * ram_dirty, both are set together.
+ */
+extern unsigned long* ram_dirty;
+extern unsigned long* ram_used;
+extern uint64_t ram_pages;
+static inline bool ram_page_dirty(hwaddr pa) {
+    uint64_t page = pa >> TARGET_PAGE_BITS;
+    return page >= ram_pages || test_bit(page, ram_dirty);
+}
+static inline bool ram_page_used(hwaddr pa) {
+    uint64_t page = pa >> TARGET_PAGE_BITS;
+    return page >= ram_pages || test_bit(page, ram_used);
+}
+static inline void ram_set_dirty(hwaddr pa) {
+    uint64_t page = pa >> TARGET_PAGE_BITS;
+    if (page < ram_pages && !test_bit(page, ram_dirty)) {
+        set_bit(page, ram_dirty);
+        set_bit(page, ram_used);
+    }
+}
+void ram_set_dirty_range(hwaddr pa, uint64_t size);
+void ram_dirty_init(uint64_t size);
+void ram_dirty_reset(CPULoongArchState *env);
 static inline bool ram_ldub_check(hwaddr addr, uint8_t *data) {if (!addr_in_ram(addr)){*data = 0xff; return false;} *data = *(uint8_t*)(ram + addr); return true;}
 #endif
 
@@ -732,12 +885,65 @@ void G_NORETURN do_raise_exception(CPULoongArchState *env, uint32_t exception, u
 uint64_t helper_fclass_s(CPULoongArchState *env, uint64_t fj);
 uint64_t helper_fclass_d(CPULoongArchState *env, uint64_t fj);
 
+#ifndef CONFIG_USER_ONLY
+static inline void cpu_clear_pwc(CPULoongArchState *env) {
+    env->pwc_gen += 1ul << PWC_GEN_SHIFT;
+    env->pwc_flush_count ++;
+}
+#endif
+
+// DA mode and DMW windows are translated without the tc, see cpu_dmw_refresh
+static inline bool cpu_dmw_hit(CPULoongArchState *env, uint64_t va) {
+    return (env->dmw_mask >> (va >> R_CSR_DMW_64_VSEG_SHIFT)) & 1;
+}
+void cpu_dmw_refresh(CPULoongArchState *env);
+
+// a new generation invalidates every tc entry
 static inline void cpu_clear_tc(CPULoongArchState *env) {
-    memset(env->tc_load, -1, sizeof(env->tc_load));
-    memset(env->tc_store, -1, sizeof(env->tc_store));
-    memset(env->tc_fetch, -1, sizeof(env->tc_fetch));
+    env->tc_gen += 1ul << TC_GEN_SHIFT;
+    env->tc_flush_count ++;
     // memset(env->inscache, 0, sizeof(env->inscache));
 }
+
+static inline uint64_t cpu_tc_tag(CPULoongArchState *env) {
+    return env->tc_gen | (FIELD_EX64(env->CSR_ASID, CSR_ASID, ASID) << TC_ASID_SHIFT) | (env->CSR_CRMD & TC_CRMD_MASK);
+}
+
+extern int tc_ways;
+extern uint64_t tc_set_mask;
+void cpu_tc_init(CPULoongArchState *env);
+TLBCache* cpu_tc_find_slow(CPULoongArchState *env, TLBCache* set, uint64_t page_addr, uint64_t tag);
+
+// tc sets are tc_ways consecutive entries, most recently used first
+static inline TLBCache* cpu_tc_set(TLBCache* tc, uint64_t page_addr) {
+    return tc + ((page_addr >> TARGET_PAGE_BITS) & tc_set_mask) * tc_ways;
+}
+
+static inline TLBCache* cpu_tc_find(CPULoongArchState *env, TLBCache* tc, uint64_t page_addr, uint64_t tag) {
+    TLBCache* set = cpu_tc_set(tc, page_addr);
+    if (likely((set->va & ~TC_FLAGS) == page_addr && set->tag == tag)) {
+        env->tc_hit_count ++;
+        return set;
+    }
+    return cpu_tc_find_slow(env, set, page_addr, tag);
+}
+
+// host address of a ram access hitting way 0, NULL for a miss or a flagged page
+static inline void* cpu_tc_host(CPULoongArchState *env, TLBCache* tc, uint64_t addr) {
+    uint64_t page_addr = addr & TARGET_PAGE_MASK;
+    TLBCache* set = cpu_tc_set(tc, page_addr);
+    if (likely(set->va == page_addr && set->tag == cpu_tc_tag(env))) {
+        env->tc_hit_count ++;
+        return (void*)(addr + set->addend);
+    }
+    return NULL;
+}
+
+void cpu_tc_fill(TLBCache* tc, uint64_t page_addr, uint64_t tag, uint64_t pa);
+void cpu_tc_fill_page(CPULoongArchState *env, TLBCache* tc, int access_type, uint64_t addr, uint64_t tag, hwaddr pa);
+TLBCacheHuge* cpu_tc_huge_find(CPULoongArchState *env, TLBCache* tc, int access_type, uint64_t addr, uint64_t tag);
+void cpu_tc_flush_range(CPULoongArchState *env, uint64_t start, uint64_t size);
+void cpu_tc_flush_asid(CPULoongArchState *env, uint16_t asid);
 #if defined(__GNUC__) && !defined(__clang__)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
@@ -753,6 +959,18 @@ static inline void cpu_put_ic(CPULoongArchState *env, bool (*trans_func)(void*,
     ic->insn = insn;
     // fprintf(stderr, "put %p %lx %08x %d %d %d %d\n", ic->trans_func, env->pc, ic->insn, ic->arg[0], ic->arg[1], ic->arg[2], ic->arg[3]);
 }
+
+static inline bool cpu_set_ic(INSCache* ic, bool (*trans_func)(void*, void*), void* arg, int insn, int op) {
+    int* args = (int*)arg;
+    ic->trans_func = trans_func;
+    ic->arg[0] = args[0];
+    ic->arg[1] = args[1];
+    ic->arg[2] = args[2];
+    ic->arg[3] = args[3];
+    ic->insn = insn;
+    ic->op = op;
+    return true;
+}
 #if defined(__GNUC__) && !defined(__clang__)
 #pragma GCC diagnostic pop
 #endif
@@ -798,6 +1016,28 @@ static inline void cpu_settimer(CPULoongArchState* env, uint64_t ticks) {
     lsassert(timer_settime(env->timerid, 0, &its, NULL) == 0);
 }
 
+// -z timer: remaining ticks as seen by the instruction at icount
+static inline int64_t cpu_timer_counter(CPULoongArchState* env, uint64_t icount) {
+    return env->timer_counter - (env->CSR_TCFG & CONSTANT_TIMER_ENABLE) * (icount - env->timer_base);
+}
+
+static inline void cpu_set_timer_counter(CPULoongArchState* env, int64_t counter, uint64_t icount) {
+    env->timer_counter = counter;
+    env->timer_base = icount;
+    if (determined && (env->CSR_TCFG & CONSTANT_TIMER_ENABLE) && counter > 0) {
+        env->timer_deadline = icount + counter;
+    } else {
+        env->timer_deadline = UINT64_MAX;
+    }
+}
+
+// an exception repeats the irq check of its instruction, which has always cost one more tick
+static inline void cpu_timer_exception_tick(CPULoongArchState* env) {
+    if (determined && (env->CSR_TCFG & CONSTANT_TIMER_ENABLE)) {
+        cpu_set_timer_counter(env, cpu_timer_counter(env, env->icount), env->icount - 1);
+    }
+}
+
 static inline void cpu_disable_timer(CPULoongArchState* env) {
     struct itimerspec its;
     its.it_value.tv_sec = 0;
@@ -811,10 +1051,10 @@ void get_dir_base_width(CPULoongArchState *env, uint64_t *dir_base,
                                uint64_t *dir_width, target_ulong level);
 #define UART_BASE 0x1fe001e0
 #define UART_END 0x1fe001e7
+// guest interface of --clone
+#define CLONE_BASE 0x100d0100
+#define CLONE_MAX 1024
 #if !defined(CONFIG_USER_ONLY)
-void do_io_st(hwaddr ha, uint64_t data, int size);
-uint64_t do_io_ld(hwaddr ha, int size);
-
 void loongarch_cpu_check_irq(CPULoongArchState *env);
 bool loongarch_cpu_has_irq(CPULoongArchState *env);
 #endif
@@ -76,6 +76,7 @@ static int loongarch_map_tlb_entry(CPULoongArchState *env, hwaddr *physical,
 
     *physical = (tlb_ppn << R_TLBENTRY_64_PPN_SHIFT) |
                 (address & MAKE_64BIT_MASK(0, tlb_ps));
+    env->mmu_ps = tlb_ps;
     *prot = PAGE_READ;
     if (tlb_d) {
         *prot |= PAGE_WRITE;
@@ -133,18 +134,21 @@ bool loongarch_tlb_search(CPULoongArchState *env, target_ulong vaddr,
         }
     }
 
-    /* Search MTLB */
-    for (i = LOONGARCH_STLB; i < LOONGARCH_TLB_MAX; ++i) {
-        tlb = &env->tlb[i];
-        tlb_e = FIELD_EX64(tlb->tlb_misc, TLB_MISC, E);
-        if (tlb_e) {
+    /* Search MTLB, only the hash chains of the page sizes in use */
+    LoongArchTLBIndex *ti = &env->tlb_index;
+    for (uint64_t ps_mask = ti->mtlb_ps_mask; ps_mask; ps_mask &= ps_mask - 1) {
+        int ps = ctz64(ps_mask);
+        vpn = (vaddr & TARGET_VIRT_MASK) >> (ps + 1);
+        for (int m = ti->mtlb_head[loongarch_mtlb_hash(vpn, ps)]; m >= 0;
+             m = ti->mtlb_next[m]) {
+            i = LOONGARCH_STLB + m;
+            tlb = &env->tlb[i];
             tlb_vppn = FIELD_EX64(tlb->tlb_misc, TLB_MISC, VPPN);
             tlb_ps = FIELD_EX64(tlb->tlb_misc, TLB_MISC, PS);
             tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
             tlb_g = FIELD_EX64(tlb->tlb_misc, TLB_MISC, G);
             compare_shift = tlb_ps + 1 - R_TLB_MISC_VPPN_SHIFT;
-            vpn = (vaddr & TARGET_VIRT_MASK) >> (tlb_ps + 1);
-            if ((tlb_g == 1 || tlb_asid == csr_asid) &&
+            if (tlb_ps == ps && (tlb_g == 1 || tlb_asid == csr_asid) &&
                 (vpn == (tlb_vppn >> compare_shift))) {
                 *index = i;
                 if (check_level_mask(CPU_CHECK_TLB_MHIT)) {
@@ -186,6 +190,73 @@ static void hw_ptw_setVD(uint64_t* csr_tlbrelo,
     }
 
     ram_std(pte_addr & TARGET_PHYS_MASK, pte);
+    ram_set_dirty(pte_addr & TARGET_PHYS_MASK);
+}
+
+static PWCache *pwc_entry(CPULoongArchState *env, uint64_t prefix, int level)
+{
+    return &env->pwc[(prefix ^ (prefix >> 8) ^ (level << 5)) & (PWC_NUM - 1)];
+}
+
+static uint64_t pwc_tag(CPULoongArchState *env, int level)
+{
+    return env->pwc_gen |
+           (FIELD_EX64(env->CSR_ASID, CSR_ASID, ASID) << PWC_ASID_SHIFT) | level;
+}
+
+/*
+ * Find the lowest directory level cached for address. Returns the level
+ * to continue the walk at, with *pt_base set to the cached entry above it.
+ */
+static int pwc_find(CPULoongArchState *env, uint64_t pgd,
+                    target_ulong address, uint64_t *pt_base)
+{
+    for (int level = 1; level <= 4; level++) {
+        uint64_t dir_base, dir_width;
+        get_dir_base_width(env, &dir_base, &dir_width, level);
+        if (!dir_width) {
+            continue;
+        }
+        uint64_t prefix = (address & TARGET_VIRT_MASK) >> dir_base;
+        PWCache *e = pwc_entry(env, prefix, level);
+        if (e->tag == pwc_tag(env, level) && e->prefix == prefix && e->pgd == pgd) {
+            env->pwc_hit_count++;
+            *pt_base = e->entry;
+            return level - 1;
+        }
+    }
+    env->pwc_miss_count++;
+    return 4;
+}
+
+static void pwc_fill(CPULoongArchState *env, uint64_t pgd,
+                     target_ulong address, int level, uint64_t entry)
+{
+    uint64_t dir_base, dir_width;
+    get_dir_base_width(env, &dir_base, &dir_width, level);
+    uint64_t prefix = (address & TARGET_VIRT_MASK) >> dir_base;
+    PWCache *e = pwc_entry(env, prefix, level);
+    e->pgd = pgd;
+    e->prefix = prefix;
+    e->tag = pwc_tag(env, level);
+    e->entry = entry;
+}
+
+/* drop the directory entries on the walk of addr, for every pgd and asid */
+void loongarch_pwc_flush_page(CPULoongArchState *env, target_ulong addr)
+{
+    for (int level = 1; level <= 4; level++) {
+        uint64_t dir_base, dir_width;
+        get_dir_base_width(env, &dir_base, &dir_width, level);
+        if (!dir_width) {
+            continue;
+        }
+        uint64_t prefix = (addr & TARGET_VIRT_MASK) >> dir_base;
+        PWCache *e = pwc_entry(env, prefix, level);
+        if (e->prefix == prefix && (e->tag & ((1 << PWC_ASID_SHIFT) - 1)) == level) {
+            e->tag = 0;
+        }
+    }
 }
 
 static int loongarch_map_address(CPULoongArchState *env, hwaddr *physical,
@@ -227,7 +298,9 @@ again:
         uint64_t dir_phys_addr = 0, pte0_phys_addr = 0, pte1_phys_addr = 0, huge_phys_addr = 0;
         bool is_huge = false;
         bool is_odd_page = false;
-        for (int level = 4; level >= 1; level--) {
+        uint64_t pgd = pt_base;
+        int level = pwc_find(env, pgd, address, &pt_base);
+        for (; level >= 1; level--) {
             uint64_t dir_base, dir_width;
             get_dir_base_width(env, &dir_base, &dir_width, level);
             if (dir_width) {
@@ -236,6 +309,9 @@ again:
                     huge_phys_addr = dir_phys_addr;
                     is_huge = true;
                 }
+                if (!is_huge) {
+                    pwc_fill(env, pgd, address, level, pt_base);
+                }
             }
         }
 
@@ -305,6 +381,33 @@ static hwaddr dmw_va2pa(CPULoongArchState *env, target_ulong va,
     }
 }
 
+// recompute the direct mapped segments, called whenever CRMD or a DMW changes
+void cpu_dmw_refresh(CPULoongArchState *env)
+{
+    uint8_t da = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, DA);
+    uint8_t pg = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, PG);
+    uint64_t plv;
+
+    env->dmw_mask = 0;
+    if (da & !pg) {
+        env->dmw_mask = 0xffff;
+        env->dmw_pa_mask = TARGET_PHYS_MASK;
+        return;
+    }
+    /* la32 windows remap the segment, leave them to get_physical_address */
+    if (!is_la64(env)) {
+        return;
+    }
+    /* same plv mapping as get_physical_address: plv 1/2 use the user bit */
+    plv = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, PLV) == 0 ? R_CSR_DMW_PLV0_MASK : R_CSR_DMW_PLV3_MASK;
+    for (int i = 0; i < 4; i++) {
+        if (env->CSR_DMW[i] & plv) {
+            env->dmw_mask |= 1 << FIELD_EX64(env->CSR_DMW[i], CSR_DMW_64, VSEG);
+        }
+    }
+    env->dmw_pa_mask = TARGET_VIRT_MASK;
+}
+
 int get_physical_address(CPULoongArchState *env, hwaddr *physical,
                          int *prot, target_ulong address,
                          MMUAccessType access_type, int mmu_idx)
@@ -316,6 +419,7 @@ int get_physical_address(CPULoongArchState *env, hwaddr *physical,
     uint8_t da = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, DA);
     uint8_t pg = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, PG);
 
+    env->mmu_ps = TARGET_PAGE_BITS;
     /* Check PG and DA */
     if (da & !pg) {
         *physical = address & TARGET_PHYS_MASK;
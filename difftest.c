@@ -34,12 +34,29 @@ static inline uint8_t* guest_to_host(uint64_t guest_paddr)
     return (uint8_t*)(ram + guest_paddr);
 }
 
+static size_t difftest_ram_size;
+
+// the reference ram is one flat mapping from pa 0
+bool addr_in_ram(hwaddr pa) {
+    return pa < difftest_ram_size;
+}
+
+bool addr_range_in_ram(hwaddr begin, hwaddr end) {
+    return end <= difftest_ram_size;
+}
+
+bool ram_is_shared(void) {
+    return false;
+}
+
 static void difftest_init_ram(size_t size)
 {
     lsassert(ram == NULL);
+    difftest_ram_size = size;
 
     ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
     lsassert(ram != NULL);
+    ram_dirty_init(size);
 
 }
 
@@ -54,8 +71,9 @@ void difftest_init(size_t ram_size_bytes)
     cs->env = env;
     cpu_reset(cs);
     loongarch_core_initfn(env);
+    cpu_tc_init(env);
     cpu_clear_tc(env);
-    env->timer_counter = INT64_MAX;
+    cpu_set_timer_counter(env, INT64_MAX, 0);
 
     current_env = env;
 
@@ -84,6 +102,9 @@ void difftest_memcpy(uint64_t guest_paddr, void* dut_buf, size_t n, bool directi
 {
     void* ref_buf = (void*)guest_to_host(guest_paddr);
     difftest_cpy_helper(ref_buf, dut_buf, n, direction);
+    if (direction == DUT_TO_REF) {
+        ram_set_dirty_range(guest_paddr, n);
+    }
 }
 
 
@@ -241,6 +262,9 @@ void difftest_csrcpy_idx(int csr_idx, uint64_t* dut_buf, uint64_t mask, bool dir
     }
 
     *csr_base_addr = (*csr_base_addr & ~mask) | (*dut_buf & mask);
+    cpu_clear_tc(current_env);
+    cpu_clear_pwc(current_env);
+    cpu_dmw_refresh(current_env);
 
 }
 
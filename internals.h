@@ -49,6 +49,8 @@ enum {
 
 bool loongarch_tlb_search(CPULoongArchState *env, target_ulong vaddr,
                           int *index);
+void loongarch_tlb_index_reset(CPULoongArchState *env);
+void loongarch_pwc_flush_page(CPULoongArchState *env, target_ulong addr);
 
 void restore_fp_status(CPULoongArchState *env);
 
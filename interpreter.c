@@ -1,6 +1,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "internals.h"
+#include "mmio.h"
 #include "tcg/tcg-gvec-desc.h"
 #include "fpu/softfloat.h"
 
@@ -10,6 +11,10 @@
 
 #include "util.h"
 
+#if defined(CONFIG_JIT)
+#include "jit.h"
+#endif
+
 #include <stdalign.h>
 
 #ifndef CONFIG_DIFF
@@ -98,6 +103,24 @@ static inline int shl_3(DisasContext *ctx, int x)
 {
     return x << 3;
 }
+
+#ifdef CONFIG_THREADED
+// finish the current instruction and jump straight to the handler of the next one
+#define THREADED_NEXT() do { \
+    env->gpr[0] = 0; \
+    env->icount ++; \
+    PERF_INC(COUNTER_INST); \
+    if (++ i == n) { \
+        goto threaded_exit; \
+    } \
+    ic ++; \
+    pa += 4; \
+    if (unlikely(ram_lduw(pa) != ic->insn)) { \
+        goto threaded_exit; \
+    } \
+    goto *dispatch[ic->op]; \
+} while (0)
+#endif
 #include "trans_la.c.inc"
 
 /*
@@ -692,9 +715,7 @@ static bool trans_bstrpick_d(CPULoongArchState *env, arg_bstrpick_d *restrict a)
 }
 
 bool is_one_page(uint64_t addr, int bytes) {
-    target_ulong pgsz = 0x4000;
-    target_ulong pgmsk = pgsz - 1;
-    return (addr & ~pgmsk) == ((addr + bytes - 1) & ~pgmsk);
+    return (addr & TARGET_PAGE_MASK) == ((addr + bytes - 1) & TARGET_PAGE_MASK);
 }
 
 bool is_two_page(uint64_t addr, int bytes) {
@@ -718,20 +739,27 @@ static hwaddr load_pa(CPULoongArchState *env, uint64_t addr) {
 #ifdef CONFIG_USER_ONLY
         return addr;
 #endif
+    if (cpu_dmw_hit(env, addr)) {
+        env->dmw_hit_count ++;
+        return addr & env->dmw_pa_mask;
+    }
     hwaddr ha;
     int prot;
-    int tc_index = TC_INDEX(addr);
-    TLBCache* tc = env->tc_load + tc_index;
     uint64_t page_addr = addr & TARGET_PAGE_MASK;
-    if (likely(page_addr == tc->va)) {
+    uint64_t tag = cpu_tc_tag(env);
+    TLBCache* tc = cpu_tc_find(env, env->tc_load, page_addr, tag);
+    if (likely(tc)) {
         uint64_t ha = (addr & (TARGET_PAGE_SIZE - 1)) | tc->pa;
         // fprintf(stderr, "%lx %lx\n", addr, ha);
         return ha;
     }
+    TLBCacheHuge* huge = cpu_tc_huge_find(env, env->tc_load, MMU_DATA_LOAD, addr, tag);
+    if (huge) {
+        return (addr & ~huge->mask) | huge->pa;
+    }
     int mmu_idx = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, PLV) == 0 ? MMU_KERNEL_IDX : MMU_USER_IDX;
     check_get_physical_address(env, &ha, &prot, addr, MMU_DATA_LOAD, mmu_idx);
-    tc->va = page_addr;
-    tc->pa = ha & TARGET_PAGE_MASK;
+    cpu_tc_fill_page(env, env->tc_load, MMU_DATA_LOAD, addr, tag, ha);
     return ha;
 }
 static hwaddr store_pa(CPULoongArchState *env, uint64_t addr) {
@@ -740,61 +768,167 @@ static hwaddr store_pa(CPULoongArchState *env, uint64_t addr) {
         return addr;
 #endif
     hwaddr ha;
+    if (cpu_dmw_hit(env, addr)) {
+        env->dmw_hit_count ++;
+        ha = addr & env->dmw_pa_mask;
+        ram_set_dirty(ha);
+        return ha;
+    }
     int prot;
-    int tc_index = TC_INDEX(addr);
-    TLBCache* tc = env->tc_store + tc_index;
     uint64_t page_addr = addr & TARGET_PAGE_MASK;
-    if (likely(page_addr == tc->va)) {
+    uint64_t tag = cpu_tc_tag(env);
+    TLBCache* tc = cpu_tc_find(env, env->tc_store, page_addr, tag);
+    TLBCacheHuge* huge;
+    if (likely(tc)) {
         ha = (addr & (TARGET_PAGE_SIZE - 1)) | tc->pa;
+        // first write to a clean page, later ones take the host fast path
+        tc->va &= ~TC_FLAG_NOTDIRTY;
         // fprintf(stderr, "%lx %lx\n", addr, ha);
+    } else if ((huge = cpu_tc_huge_find(env, env->tc_store, MMU_DATA_STORE, addr, tag))) {
+        ha = (addr & ~huge->mask) | huge->pa;
     } else {
         int mmu_idx = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, PLV) == 0 ? MMU_KERNEL_IDX : MMU_USER_IDX;
         check_get_physical_address(env, &ha, &prot, addr, MMU_DATA_STORE, mmu_idx);
-        tc->va = page_addr;
-        tc->pa = ha & TARGET_PAGE_MASK;
+        cpu_tc_fill_page(env, env->tc_store, MMU_DATA_STORE, addr, tag, ha);
     }
+    ram_set_dirty(ha);
     return ha;
 }
 #if defined(CONFIG_USER_ONLY) || defined(CONFIG_DIFF)
 #define is_io(...) false
 #else
-// exclude 32MB bios
+// devices and holes, see mmio.c
 static bool is_io(hwaddr ha) {
-    return (ha >= 0x10000000 && ha < 0x1c000000)
-            || (ha > 0x1e000000 && ha < 0x90000000);
+    return !addr_in_ram(ha);
 }
 #endif
 
+// host address of a ram access that is direct mapped or hits tc, NULL when load_pa/store_pa has to run
+static inline void* load_host(CPULoongArchState *env, uint64_t va, int bytes) {
+    if (va & (bytes - 1)) {
+        PERF_INC(COUNTER_INST_MISALIGNED_LOAD);
+    }
+#ifdef CONFIG_USER_ONLY
+    PERF_INC(COUNTER_INST_LOAD);
+    return (void*)va;
+#else
+    void* host = NULL;
+    if (is_aligned(va, bytes)) {
+        if (cpu_dmw_hit(env, va)) {
+            hwaddr pa = va & env->dmw_pa_mask;
+            if (addr_in_ram(pa)) {
+                env->dmw_hit_count ++;
+                host = (void*)ram + pa;
+            }
+        } else {
+            host = cpu_tc_host(env, env->tc_load, va);
+        }
+    }
+    if (host) {
+        PERF_INC(COUNTER_INST_LOAD);
+    }
+    return host;
+#endif
+}
+
+static inline void* store_host(CPULoongArchState *env, uint64_t va, int bytes) {
+    if (va & (bytes - 1)) {
+        PERF_INC(COUNTER_INST_MISALIGNED_STORE);
+    }
+#ifdef CONFIG_USER_ONLY
+    PERF_INC(COUNTER_INST_STORE);
+    return (void*)va;
+#else
+    void* host = NULL;
+    if (is_aligned(va, bytes)) {
+        if (cpu_dmw_hit(env, va)) {
+            hwaddr pa = va & env->dmw_pa_mask;
+            if (addr_in_ram(pa)) {
+                env->dmw_hit_count ++;
+                ram_set_dirty(pa);
+                host = (void*)ram + pa;
+            }
+        } else {
+            host = cpu_tc_host(env, env->tc_store, va);
+        }
+    }
+    if (host) {
+        PERF_INC(COUNTER_INST_STORE);
+    }
+    return host;
+#endif
+}
+
 static uint64_t add_addr(int64_t base, int64_t disp) {
     return (uint64_t)(base + disp);
 }
 
+static int8_t ld_b(CPULoongArchState *env, uint64_t va);
+static void st_b(CPULoongArchState *env, uint64_t va, uint8_t data);
+
+// an access split by a page boundary, ha translates va. The last byte is
+// translated next, as the byte loop this replaces did, then each part is
+// one host access. An io second page still goes byte by byte.
+static uint64_t ld_cross_page(CPULoongArchState *env, uint64_t va, hwaddr ha, int bytes) {
+    int n = TARGET_PAGE_SIZE - (va & (TARGET_PAGE_SIZE - 1));
+    hwaddr ha2 = load_pa(env, va + bytes - 1) - (bytes - 1 - n);
+    uint64_t data = 0;
+    PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
+    if (unlikely(is_io(ha2))) {
+        for (int i = (bytes - 1); i >= 0; i--) {
+            data |= ((uint64_t)ld_b(env, va + i) & 0xff) << (i * 8);
+        }
+        return data;
+    }
+    memcpy(&data, ram_host(ha), n);
+    memcpy((char*)&data + n, ram_host(ha2), bytes - n);
+    return data;
+}
+
+static void st_cross_page(CPULoongArchState *env, uint64_t va, hwaddr ha, uint64_t data, int bytes) {
+    int n = TARGET_PAGE_SIZE - (va & (TARGET_PAGE_SIZE - 1));
+    hwaddr ha2 = store_pa(env, va + bytes - 1) - (bytes - 1 - n);
+    PERF_INC(COUNTER_INST_CROSS_PAGE_STORE);
+    if (unlikely(is_io(ha2))) {
+        for (int i = (bytes - 1); i >= 0; i--) {
+            st_b(env, va + i, (data >> (i * 8)) & 0xff);
+        }
+        return;
+    }
+    memcpy(ram_host(ha), &data, n);
+    memcpy(ram_host(ha2), (char*)&data + n, bytes - n);
+}
+
 static int8_t ld_b(CPULoongArchState *env, uint64_t va) {
+    void* host = load_host(env, va, 1);
+    if (likely(host)) {
+        return *(int8_t*)host;
+    }
     hwaddr ha = load_pa(env, va);
 #if defined(CONFIG_USER_ONLY)
     return ram_ldb(ha);
 #else
-    return is_io(ha) ? do_io_ld(ha, 1) : ram_ldb(ha);
+    return is_io(ha) ? mmio_read(ha, 1) : ram_ldb(ha);
 #endif
 }
 
 static int16_t ld_h(CPULoongArchState *env, uint64_t va) {
     uint64_t data;
     const int data_size = 2;
+    void* host = load_host(env, va, data_size);
+    if (likely(host)) {
+        return *(int16_t*)host;
+    }
     hwaddr ha = load_pa(env, va);
     if (is_io(ha)) {
 #if !defined(CONFIG_USER_ONLY)
-        data = do_io_ld(ha, data_size);
+        data = mmio_read(ha, data_size);
 #endif
     } else {
         if (is_aligned(va, data_size)) {
             data = ram_ldh(ha);
         } else {
-            PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
-            data = 0;
-            for (int i = (data_size - 1); i >= 0; i--){
-                data |= (((uint16_t)ld_b(env, va + i) & 0xff) << (i * 8)) ;
-            }
+            data = ld_cross_page(env, va, ha, data_size);
         }
     }
     return data;
@@ -803,20 +937,20 @@ static int16_t ld_h(CPULoongArchState *env, uint64_t va) {
 static int32_t ld_w(CPULoongArchState *env, uint64_t va) {
     uint64_t data;
     const int data_size = 4;
+    void* host = load_host(env, va, data_size);
+    if (likely(host)) {
+        return *(int32_t*)host;
+    }
     hwaddr ha = load_pa(env, va);
     if (is_io(ha)) {
 #if !defined(CONFIG_USER_ONLY)
-        data = do_io_ld(ha, data_size);
+        data = mmio_read(ha, data_size);
 #endif
     } else {
         if (is_aligned(va, data_size)) {
             data = ram_ldw(ha);
         } else {
-            PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
-            data = 0;
-            for (int i = (data_size - 1); i >= 0; i--){
-                data |= (((uint32_t)ld_b(env, va + i) & 0xff) << (i * 8)) ;
-            }
+            data = ld_cross_page(env, va, ha, data_size);
         }
     }
     return data;
@@ -825,20 +959,20 @@ static int32_t ld_w(CPULoongArchState *env, uint64_t va) {
 static int64_t ld_d(CPULoongArchState *env, uint64_t va) {
     uint64_t data;
     const int data_size = 8;
+    void* host = load_host(env, va, data_size);
+    if (likely(host)) {
+        return *(int64_t*)host;
+    }
     hwaddr ha = load_pa(env, va);
     if (is_io(ha)) {
 #if !defined(CONFIG_USER_ONLY)
-        data = do_io_ld(ha, data_size);
+        data = mmio_read(ha, data_size);
 #endif
     } else {
         if (is_aligned(va, data_size)) {
             data = ram_ldd(ha);
         } else {
-            PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
-            data = 0;
-            for (int i = (data_size - 1); i >= 0; i--){
-                data |= (((uint64_t)ld_b(env, va + i) & 0xff) << (i * 8)) ;
-            }
+            data = ld_cross_page(env, va, ha, data_size);
         }
     }
     return data;
@@ -882,67 +1016,78 @@ static int64_t ld_d(CPULoongArchState *env, uint64_t va) {
 // }
 
 static void st_b(CPULoongArchState *env, uint64_t va, uint8_t data) {
+    void* host = store_host(env, va, 1);
+    if (likely(host)) {
+        *(uint8_t*)host = data;
+        return;
+    }
     hwaddr ha = store_pa(env, va);
 #if defined(CONFIG_USER_ONLY)
     ram_stb(ha, data);
 #else
-    is_io(ha) ? do_io_st(ha, data, 1) : ram_stb(ha, data);
+    is_io(ha) ? mmio_write(ha, data, 1) : ram_stb(ha, data);
 #endif
 }
 
 static void st_h(CPULoongArchState *env, uint64_t va, uint16_t data) {
     const int data_size = 2;
+    void* host = store_host(env, va, data_size);
+    if (likely(host)) {
+        *(uint16_t*)host = data;
+        return;
+    }
     hwaddr ha = store_pa(env, va);
     if (is_io(ha)) {
 #if !defined(CONFIG_USER_ONLY)
-        do_io_st(ha, data, data_size);
+        mmio_write(ha, data, data_size);
 #endif
     } else {
         if (is_aligned(va, data_size)) {
             ram_sth(ha, data);
         } else {
-            PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
-            for (int i = (data_size - 1); i >= 0; i--){
-                st_b(env, va + i, (data >> (i * 8)) & 0xff);
-            }
+            st_cross_page(env, va, ha, data, data_size);
         }
     }
 }
 
 static void st_w(CPULoongArchState *env, uint64_t va, uint32_t data) {
     const int data_size = 4;
+    void* host = store_host(env, va, data_size);
+    if (likely(host)) {
+        *(uint32_t*)host = data;
+        return;
+    }
     hwaddr ha = store_pa(env, va);
     if (is_io(ha)) {
 #if !defined(CONFIG_USER_ONLY)
-        do_io_st(ha, data, data_size);
+        mmio_write(ha, data, data_size);
 #endif
     } else {
         if (is_aligned(va, data_size)) {
             ram_stw(ha, data);
         } else {
-            PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
-            for (int i = (data_size - 1); i >= 0; i--){
-                st_b(env, va + i, (data >> (i * 8)) & 0xff);
-            }
+            st_cross_page(env, va, ha, data, data_size);
         }
     }
 }
 
 static void st_d(CPULoongArchState *env, uint64_t va, uint64_t data) {
     const int data_size = 8;
+    void* host = store_host(env, va, data_size);
+    if (likely(host)) {
+        *(uint64_t*)host = data;
+        return;
+    }
     hwaddr ha = store_pa(env, va);
     if (is_io(ha)) {
 #if !defined(CONFIG_USER_ONLY)
-        do_io_st(ha, data, data_size);
+        mmio_write(ha, data, data_size);
 #endif
     } else {
         if (is_aligned(va, data_size)) {
             ram_std(ha, data);
         } else {
-            PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
-            for (int i = (data_size - 1); i >= 0; i--){
-                st_b(env, va + i, (data >> (i * 8)) & 0xff);
-            }
+            st_cross_page(env, va, ha, data, data_size);
         }
     }
 }
@@ -979,6 +1124,48 @@ static void st_d(CPULoongArchState *env, uint64_t va, uint64_t data) {
 //     }
 // }
 
+// 16/32 byte LSX/LASX accesses, a page crossing one translates both pages
+// before vd or memory changes
+static void ld_vec(CPULoongArchState *env, uint64_t va, VReg* vd, int bytes) {
+    void* host = load_host(env, va, bytes);
+    if (likely(host)) {
+        memcpy(vd, host, bytes);
+        return;
+    }
+    hwaddr ha = load_pa(env, va);
+    lsassert(!is_io(ha));
+    if (is_aligned(va, bytes)) {
+        memcpy(vd, ram_host(ha), bytes);
+    } else {
+        PERF_INC(COUNTER_INST_CROSS_PAGE_LOAD);
+        int n = TARGET_PAGE_SIZE - (va & (TARGET_PAGE_SIZE - 1));
+        hwaddr ha2 = load_pa(env, va + n);
+        lsassert(!is_io(ha2));
+        memcpy(vd, ram_host(ha), n);
+        memcpy((char*)vd + n, ram_host(ha2), bytes - n);
+    }
+}
+
+static void st_vec(CPULoongArchState *env, uint64_t va, VReg* vd, int bytes) {
+    void* host = store_host(env, va, bytes);
+    if (likely(host)) {
+        memcpy(host, vd, bytes);
+        return;
+    }
+    hwaddr ha = store_pa(env, va);
+    lsassert(!is_io(ha));
+    if (is_aligned(va, bytes)) {
+        memcpy(ram_host(ha), vd, bytes);
+    } else {
+        PERF_INC(COUNTER_INST_CROSS_PAGE_STORE);
+        int n = TARGET_PAGE_SIZE - (va & (TARGET_PAGE_SIZE - 1));
+        hwaddr ha2 = store_pa(env, va + n);
+        lsassert(!is_io(ha2));
+        memcpy(ram_host(ha), vd, n);
+        memcpy(ram_host(ha2), (char*)vd + n, bytes - n);
+    }
+}
+
 static bool trans_ld_b(CPULoongArchState *env, arg_ld_b *restrict a) {
     env->gpr[a->rd] = (int64_t)ld_b(env, add_addr(env->gpr[a->rj], a->imm));
     env->pc += 4;
@@ -2135,7 +2322,7 @@ uint64_t helper_read_csr(CPULoongArchState *env, int csr_index) {
         case LOONGARCH_CSR_SAVE(7)        :old_v = env->CSR_SAVE[7]; break;
         case LOONGARCH_CSR_TID            :old_v = sextract64(env->CSR_TID, 0, 32); break;
         case LOONGARCH_CSR_TCFG           :old_v = env->CSR_TCFG; break;
-        case LOONGARCH_CSR_TVAL           :old_v = env->timer_counter; break;
+        case LOONGARCH_CSR_TVAL           :old_v = cpu_timer_counter(env, env->icount); break;
         case LOONGARCH_CSR_CNTC           :old_v = env->CSR_CNTC; break;
         case LOONGARCH_CSR_TICLR          :old_v = 0; break;
         case LOONGARCH_CSR_LLBCTL         :old_v = env->CSR_LLBCTL; break;
@@ -2193,12 +2380,12 @@ uint64_t mask_write(uint64_t old, uint64_t new, uint64_t mask) {
 uint64_t helper_write_csr(CPULoongArchState *env, int csr_index, uint64_t new_v, uint64_t mask) {
     uint64_t old_v = 0;
     switch (csr_index) {
-        case LOONGARCH_CSR_CRMD           :old_v = env->CSR_CRMD; env->CSR_CRMD = mask_write(env->CSR_CRMD, new_v, mask & LOONGARCH_CSR_CRMD_WMASK); break;
+        case LOONGARCH_CSR_CRMD           :old_v = env->CSR_CRMD; env->CSR_CRMD = mask_write(env->CSR_CRMD, new_v, mask & LOONGARCH_CSR_CRMD_WMASK); cpu_dmw_refresh(env); env->irq_pending = true; break;
         case LOONGARCH_CSR_PRMD           :old_v = env->CSR_PRMD; env->CSR_PRMD = mask_write(env->CSR_PRMD, new_v, mask & LOONGARCH_CSR_PRMD_WMASK); break;
         case LOONGARCH_CSR_EUEN           :old_v = env->CSR_EUEN; env->CSR_EUEN = mask_write(env->CSR_EUEN, new_v, mask & LOONGARCH_CSR_EUEN_WMASK); break;
         case LOONGARCH_CSR_MISC           :old_v = env->CSR_MISC; env->CSR_MISC = mask_write(env->CSR_MISC, new_v, mask & LOONGARCH_CSR_MISC_WMASK); break;
-        case LOONGARCH_CSR_ECFG           :old_v = env->CSR_ECFG; env->CSR_ECFG = mask_write(env->CSR_ECFG, new_v, mask & LOONGARCH_CSR_ECFG_WMASK); break;
-        case LOONGARCH_CSR_ESTAT          :old_v = env->CSR_ESTAT; env->CSR_ESTAT = mask_write(env->CSR_ESTAT, new_v, mask & LOONGARCH_CSR_ESTAT_WMASK); break;
+        case LOONGARCH_CSR_ECFG           :old_v = env->CSR_ECFG; env->CSR_ECFG = mask_write(env->CSR_ECFG, new_v, mask & LOONGARCH_CSR_ECFG_WMASK); env->irq_pending = true; break;
+        case LOONGARCH_CSR_ESTAT          :old_v = env->CSR_ESTAT; env->CSR_ESTAT = mask_write(env->CSR_ESTAT, new_v, mask & LOONGARCH_CSR_ESTAT_WMASK); env->irq_pending = true; break;
         case LOONGARCH_CSR_ERA            :old_v = env->CSR_ERA; env->CSR_ERA = mask_write(env->CSR_ERA, new_v, mask); break;
         case LOONGARCH_CSR_BADV           :old_v = env->CSR_BADV; env->CSR_BADV = mask_write(env->CSR_BADV, new_v, mask); break;
         case LOONGARCH_CSR_BADI           :old_v = env->CSR_BADI; break;
@@ -2207,12 +2394,12 @@ uint64_t helper_write_csr(CPULoongArchState *env, int csr_index, uint64_t new_v,
         case LOONGARCH_CSR_TLBEHI         :old_v = sextract64(env->CSR_TLBEHI, 0, FIELD_EX64(env->cpucfg[1], CPUCFG1, VALEN) + 1); env->CSR_TLBEHI = mask_write(env->CSR_TLBEHI, new_v, mask & LOONGARCH_CSR_TLBEHI_64_WMASK); break;
         case LOONGARCH_CSR_TLBELO0        :old_v = env->CSR_TLBELO0; env->CSR_TLBELO0 = mask_write(env->CSR_TLBELO0, new_v, mask & LOONGARCH_CSR_TLBELO_64_WMASK); break;
         case LOONGARCH_CSR_TLBELO1        :old_v = env->CSR_TLBELO1; env->CSR_TLBELO1 = mask_write(env->CSR_TLBELO1, new_v, mask & LOONGARCH_CSR_TLBELO_64_WMASK); break;
-        case LOONGARCH_CSR_ASID           :old_v = env->CSR_ASID; env->CSR_ASID = mask_write(env->CSR_ASID, new_v, mask & LOONGARCH_CSR_ASID_WMASK); cpu_clear_tc(env); break;
+        case LOONGARCH_CSR_ASID           :old_v = env->CSR_ASID; env->CSR_ASID = mask_write(env->CSR_ASID, new_v, mask & LOONGARCH_CSR_ASID_WMASK); break;
         case LOONGARCH_CSR_PGDL           :old_v = env->CSR_PGDL; env->CSR_PGDL = mask_write(env->CSR_PGDL, new_v, mask & LOONGARCH_CSR_PGDL_WMASK); break;
         case LOONGARCH_CSR_PGDH           :old_v = env->CSR_PGDH; env->CSR_PGDH = mask_write(env->CSR_PGDH, new_v, mask & LOONGARCH_CSR_PGDH_WMASK); break;
         case LOONGARCH_CSR_PGD            :old_v = helper_csrrd_pgd(env); break;
-        case LOONGARCH_CSR_PWCL           :old_v = sextract64(env->CSR_PWCL, 0, 32); env->CSR_PWCL = mask_write(env->CSR_PWCL, new_v, mask & LOONGARCH_CSR_PWCL_WMASK); break;
-        case LOONGARCH_CSR_PWCH           :old_v = env->CSR_PWCH; env->CSR_PWCH = mask_write(env->CSR_PWCH, new_v, mask & LOONGARCH_CSR_PWCH_WMASK); break;
+        case LOONGARCH_CSR_PWCL           :old_v = sextract64(env->CSR_PWCL, 0, 32); env->CSR_PWCL = mask_write(env->CSR_PWCL, new_v, mask & LOONGARCH_CSR_PWCL_WMASK); cpu_clear_pwc(env); break;
+        case LOONGARCH_CSR_PWCH           :old_v = env->CSR_PWCH; env->CSR_PWCH = mask_write(env->CSR_PWCH, new_v, mask & LOONGARCH_CSR_PWCH_WMASK); cpu_clear_pwc(env); break;
         case LOONGARCH_CSR_STLBPS         :old_v = env->CSR_STLBPS; env->CSR_STLBPS = mask_write(env->CSR_STLBPS, new_v, mask & LOONGARCH_CSR_STLBPS_WMASK); cpu_clear_tc(env); break;
         case LOONGARCH_CSR_RVACFG         :old_v = env->CSR_RVACFG; env->CSR_RVACFG = mask_write(env->CSR_RVACFG, new_v, mask & LOONGARCH_CSR_RVACFG_WMASK); break;
         case LOONGARCH_CSR_CPUID          :old_v = env->CSR_CPUID; break;
@@ -2232,13 +2419,13 @@ uint64_t helper_write_csr(CPULoongArchState *env, int csr_index, uint64_t new_v,
 #ifndef CONFIG_DIFF
             if (env->CSR_TCFG & 1) {
                 if (determined) {
-                    env->timer_counter = (env->CSR_TCFG & CONSTANT_TIMER_TICK_MASK) / TIME_SCALE;
+                    cpu_set_timer_counter(env, (env->CSR_TCFG & CONSTANT_TIMER_TICK_MASK) / TIME_SCALE, env->icount);
                 } else {
                     cpu_settimer(env, env->CSR_TCFG & CONSTANT_TIMER_TICK_MASK);
                 }
             } else {
                 if (determined) {
-                    env->timer_counter = -1;
+                    cpu_set_timer_counter(env, -1, env->icount);
                 } else {
                     cpu_disable_timer(env);
                 }
@@ -2278,10 +2465,10 @@ uint64_t helper_write_csr(CPULoongArchState *env, int csr_index, uint64_t new_v,
         case LOONGARCH_CSR_MERRERA        :old_v = env->CSR_MERRERA; env->CSR_MERRERA = mask_write(env->CSR_MERRERA, new_v, mask); break;
         case LOONGARCH_CSR_MERRSAVE       :old_v = env->CSR_MERRSAVE; env->CSR_MERRSAVE = mask_write(env->CSR_MERRSAVE, new_v, mask); break;
         case LOONGARCH_CSR_CTAG           :old_v = env->CSR_CTAG; env->CSR_CTAG = mask_write(env->CSR_CTAG, new_v, mask); break;
-        case LOONGARCH_CSR_DMW(0)         :old_v = env->CSR_DMW[0]; env->CSR_DMW[0] = mask_write(env->CSR_DMW[0], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_clear_tc(env); break;
-        case LOONGARCH_CSR_DMW(1)         :old_v = env->CSR_DMW[1]; env->CSR_DMW[1] = mask_write(env->CSR_DMW[1], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_clear_tc(env); break;
-        case LOONGARCH_CSR_DMW(2)         :old_v = env->CSR_DMW[2]; env->CSR_DMW[2] = mask_write(env->CSR_DMW[2], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_clear_tc(env); break;
-        case LOONGARCH_CSR_DMW(3)         :old_v = env->CSR_DMW[3]; env->CSR_DMW[3] = mask_write(env->CSR_DMW[3], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_clear_tc(env); break;
+        case LOONGARCH_CSR_DMW(0)         :old_v = env->CSR_DMW[0]; env->CSR_DMW[0] = mask_write(env->CSR_DMW[0], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_dmw_refresh(env); break;
+        case LOONGARCH_CSR_DMW(1)         :old_v = env->CSR_DMW[1]; env->CSR_DMW[1] = mask_write(env->CSR_DMW[1], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_dmw_refresh(env); break;
+        case LOONGARCH_CSR_DMW(2)         :old_v = env->CSR_DMW[2]; env->CSR_DMW[2] = mask_write(env->CSR_DMW[2], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_dmw_refresh(env); break;
+        case LOONGARCH_CSR_DMW(3)         :old_v = env->CSR_DMW[3]; env->CSR_DMW[3] = mask_write(env->CSR_DMW[3], new_v, mask & LOONGARCH_CSR_DMW_64_WMASK); cpu_dmw_refresh(env); break;
         case LOONGARCH_CSR_DBG            :old_v = env->CSR_DBG; break;
         case LOONGARCH_CSR_DERA           :old_v = env->CSR_DERA; env->CSR_DERA = mask_write(env->CSR_DERA, new_v, mask); break;
         case LOONGARCH_CSR_DSAVE          :old_v = env->CSR_DSAVE; env->CSR_DSAVE = mask_write(env->CSR_DSAVE, new_v, mask); break;
@@ -2380,7 +2567,6 @@ static bool trans_tlbrd(CPULoongArchState *env, arg_tlbrd *restrict a) {
 static bool trans_tlbwr(CPULoongArchState *env, arg_tlbwr *restrict a) {
     CHECK_PLV(0);
     helper_tlbwr(env);
-    cpu_clear_tc(env);
     env->pc += 4;
     return true;
 }
@@ -2400,8 +2586,35 @@ static bool trans_tlbflush(CPULoongArchState *env, arg_tlbflush *restrict a) {
 }
 static bool trans_invtlb(CPULoongArchState *env, arg_invtlb *restrict a) {
     CHECK_PLV(0);
-    helper_invtlb_all(env);
-    cpu_clear_tc(env);
+    switch (a->imm) {
+    case 0:
+    case 1:
+        helper_invtlb_all(env);
+        break;
+    case 2:
+        helper_invtlb_all_g(env, 1);
+        break;
+    case 3:
+        helper_invtlb_all_g(env, 0);
+        break;
+    case 4:
+        helper_invtlb_all_asid(env, env->gpr[a->rj]);
+        break;
+    case 5:
+        helper_invtlb_page_asid(env, env->gpr[a->rj], env->gpr[a->rk]);
+        break;
+    case 6:
+        helper_invtlb_page_asid_or_g(env, env->gpr[a->rj], env->gpr[a->rk]);
+        break;
+    default:
+        return false;
+    }
+    // the page walk cache is kept coherent by invtlb like the tlb
+    if (a->imm == 5 || a->imm == 6) {
+        loongarch_pwc_flush_page(env, env->gpr[a->rk]);
+    } else {
+        cpu_clear_pwc(env);
+    }
     env->pc += 4;
     return true;
 }
@@ -2427,7 +2640,6 @@ static bool trans_ldpte(CPULoongArchState *env, arg_ldpte *restrict a) {
 static bool trans_ertn(CPULoongArchState *env, arg_ertn *restrict a) {
     CHECK_PLV(0);
     helper_ertn(env);
-    cpu_clear_tc(env);
     return true;
 }
 static bool trans_idle(CPULoongArchState *env, arg_idle *restrict a) {
@@ -4176,37 +4388,25 @@ gen_trans_vvid(vextrins_h, 16, vextrins_h)
 gen_trans_vvid(vextrins_b, 16, vextrins_b)
 static bool trans_vld(CPULoongArchState *env, arg_vld *restrict a) {
     CHECK_FPE(16);
-    uint64_t va = add_addr(env->gpr[a->rj], a->imm);
-    lsassert(!is_io(load_pa(env, va)));
-    env->fpr[a->vd].vreg.D[0] = ld_d(env, va);
-    env->fpr[a->vd].vreg.D[1] = ld_d(env, va + 8);
+    ld_vec(env, add_addr(env->gpr[a->rj], a->imm), &env->fpr[a->vd].vreg, 16);
     env->pc += 4;
     return true;
 }
 static bool trans_vst(CPULoongArchState *env, arg_vst *restrict a) {
     CHECK_FPE(16);
-    uint64_t va = add_addr(env->gpr[a->rj], a->imm);
-    lsassert(!is_io(store_pa(env, va)));
-    st_d(env, va, env->fpr[a->vd].vreg.D[0]);
-    st_d(env, va + 8, env->fpr[a->vd].vreg.D[1]);
+    st_vec(env, add_addr(env->gpr[a->rj], a->imm), &env->fpr[a->vd].vreg, 16);
     env->pc += 4;
     return true;
 }
 static bool trans_vldx(CPULoongArchState *env, arg_vldx *restrict a) {
     CHECK_FPE(16);
-    uint64_t va = add_addr(env->gpr[a->rj], env->gpr[a->rk]);
-    lsassert(!is_io(load_pa(env, va)));
-    env->fpr[a->vd].vreg.D[0] = ld_d(env, va);
-    env->fpr[a->vd].vreg.D[1] = ld_d(env, va + 8);
+    ld_vec(env, add_addr(env->gpr[a->rj], env->gpr[a->rk]), &env->fpr[a->vd].vreg, 16);
     env->pc += 4;
     return true;
 }
 static bool trans_vstx(CPULoongArchState *env, arg_vstx *restrict a) {
     CHECK_FPE(16);
-    uint64_t va = add_addr(env->gpr[a->rj], env->gpr[a->rk]);
-    lsassert(!is_io(store_pa(env, va)));
-    st_d(env, va, env->fpr[a->vd].vreg.D[0]);
-    st_d(env, va + 8, env->fpr[a->vd].vreg.D[1]);
+    st_vec(env, add_addr(env->gpr[a->rj], env->gpr[a->rk]), &env->fpr[a->vd].vreg, 16);
     env->pc += 4;
     return true;
 }
@@ -4454,10 +4654,7 @@ static bool trans_xvinsve0_w(CPULoongArchState *env, arg_xvinsve0_w *restrict a)
 }
 static bool trans_xvld(CPULoongArchState *env, arg_xvld *restrict a) {
     CHECK_FPE(32);
-    int32_t ele_cnt = 32 / 8;
-    for (int32_t i = 0; i < ele_cnt; i++) {
-        env->fpr[a->vd].vreg.D[i] = ld_d(env, add_addr(env->gpr[a->rj], a->imm + (i * 8)));
-    }
+    ld_vec(env, add_addr(env->gpr[a->rj], a->imm), &env->fpr[a->vd].vreg, 32);
     env->pc += 4;
     return true;
 }
@@ -4467,10 +4664,7 @@ static bool trans_xvldrepl_w(CPULoongArchState *env, arg_xvldrepl_w *restrict a)
 static bool trans_xvldrepl_d(CPULoongArchState *env, arg_xvldrepl_d *restrict a) {CHECK_FPE(32); int64_t data = ld_d(env, add_addr(env->gpr[a->rj], a->imm));for (size_t i = 0; i < 4; i++){env->fpr[a->vd].vreg.D[i] = data;}env->pc += 4;return true;}
 static bool trans_xvldx(CPULoongArchState *env, arg_xvldx *restrict a) {
     CHECK_FPE(32);
-    int32_t ele_cnt = 32 / 8;
-    for (int32_t i = 0; i < ele_cnt; i++) {
-        env->fpr[a->vd].vreg.D[i] = ld_d(env, add_addr(env->gpr[a->rj], env->gpr[a->rk] + (i * 8)));
-    }
+    ld_vec(env, add_addr(env->gpr[a->rj], env->gpr[a->rk]), &env->fpr[a->vd].vreg, 32);
     env->pc += 4;
     return true;
 }
@@ -4899,10 +5093,7 @@ gen_trans_vvvd(xvssub_wu, 32, gvec_ussub32)
 gen_trans_vvvd(xvssub_du, 32, gvec_ussub64)
 static bool trans_xvst(CPULoongArchState *env, arg_xvst *restrict a) {
     CHECK_FPE(32);
-    int32_t ele_cnt = 32 / 8;
-    for (int32_t i = 0; i < ele_cnt; i++) {
-        st_d(env, add_addr(env->gpr[a->rj], a->imm + (i * 8)), env->fpr[a->vd].vreg.D[i]);
-    }
+    st_vec(env, add_addr(env->gpr[a->rj], a->imm), &env->fpr[a->vd].vreg, 32);
     env->pc += 4;
     return true;
 }
@@ -4912,10 +5103,7 @@ static bool trans_xvstelm_w(CPULoongArchState *env, arg_xvstelm_w *restrict a) {
 static bool trans_xvstelm_d(CPULoongArchState *env, arg_xvstelm_d *restrict a) {CHECK_FPE(32); st_d(env, add_addr(env->gpr[a->rj], a->imm), env->fpr[a->vd].vreg.D[a->imm2]);env->pc += 4;return true;}
 static bool trans_xvstx(CPULoongArchState *env, arg_xvstx *restrict a) {
     CHECK_FPE(32);
-    int32_t ele_cnt = 32 / 8;
-    for (int32_t i = 0; i < ele_cnt; i++) {
-        st_d(env, add_addr(env->gpr[a->rj], env->gpr[a->rk] + (i * 8)), env->fpr[a->vd].vreg.D[i]);
-    }
+    st_vec(env, add_addr(env->gpr[a->rj], env->gpr[a->rk]), &env->fpr[a->vd].vreg, 32);
     env->pc += 4;
     return true;
 }
@@ -5294,6 +5482,27 @@ static bool trans_xvfrintirp_s(DisasContext *env, arg_xvfrintirp_s *a) {__NOT_IM
 static bool trans_xvfrintirz_d(DisasContext *env, arg_xvfrintirz_d *a) {__NOT_IMPLEMENTED__}
 static bool trans_xvfrintirz_s(DisasContext *env, arg_xvfrintirz_s *a) {__NOT_IMPLEMENTED__}
 
+bool interpreter_decode(CPULoongArchState *env, uint32_t insn, INSCache* ic) {
+    return decode_ic(env, insn, ic);
+}
+
+#if defined(CONFIG_JIT)
+int interpreter_jit_op(INSCache* ic) {
+#define JIT_OP_MATCH(op, name) \
+    if (ic->trans_func == (bool (*)(void*, void*))trans_##name) return JIT_##op;
+    JIT_OP_LIST(JIT_OP_MATCH)
+#undef JIT_OP_MATCH
+    return JIT_CALL;
+}
+#endif
+
+#if defined(CONFIG_THREADED)
+// returns the number of instructions executed, less than n if guest code changed under the block
+int interpreter_exec_tb(CPULoongArchState *env, INSCache* ic, int n, hwaddr pa) {
+    return exec_threaded(env, ic, n, pa);
+}
+#endif
+
 bool interpreter(CPULoongArchState *env, uint32_t insn, INSCache* ic) {
     if (ic) {
         ic->trans_func(env, ic->arg);
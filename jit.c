@@ -0,0 +1,615 @@
+/*
+ * x86-64 template JIT for hot TBCache blocks
+ *
+ * Integer ALU and branch handlers are emitted inline. The gprs they use are
+ * cached in caller saved host registers until the next trans_* call, side
+ * exit or the end of the block, where dirty ones are written back to env
+ * (rbx). Every other instruction calls its trans_* handler with env->gpr,
+ * env->pc and icount brought up to date first, so exceptions and helpers see
+ * exactly the interpreter state.
+ * Guest instruction words are compared against memory before they run, the
+ * same check tb_exec does per instruction.
+ */
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "jit.h"
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11,
+};
+
+// x86 condition codes
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd,
+};
+
+// group 1 /ext and shift /ext
+enum {
+    ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7,
+    SH_SHL = 4, SH_SHR = 5, SH_SAR = 7,
+};
+
+// opcodes of op reg, r/m
+enum {
+    OP_MOV = 0x8b, OP_TEST = 0x85, OP_IMUL = 0x0faf, OP_MOVSXB = 0x0fbe, OP_MOVSXW = 0x0fbf,
+};
+
+static uint8_t* jit_buffer;
+static uint8_t* jit_ptr;
+static bool jit_disabled;
+static uint8_t* code;
+
+#define ENV_OFF(field) ((int32_t)offsetof(CPULoongArchState, field))
+#define GPR_OFF(r) (ENV_OFF(gpr) + (int32_t)(r) * 8)
+
+static inline void emit1(uint8_t b) { *code++ = b; }
+static inline void emit4(uint32_t v) { memcpy(code, &v, 4); code += 4; }
+static inline void emit8(uint64_t v) { memcpy(code, &v, 8); code += 8; }
+
+static inline void emit_rex(bool w, int reg, int rm) {
+    int rex = 0x40 | w << 3 | (reg & 8) >> 1 | (rm & 8) >> 3;
+    if (rex != 0x40) emit1(rex);
+}
+
+// modrm for [rbx + disp32]
+static inline void emit_env(int reg, int32_t disp) {
+    emit1(0x80 | (reg & 7) << 3 | RBX);
+    emit4(disp);
+}
+
+// mov reg, [rbx + disp], 32-bit load zero extends
+static void emit_ld(bool w, int reg, int32_t disp) {
+    emit_rex(w, reg, RBX);
+    emit1(0x8b);
+    emit_env(reg, disp);
+}
+
+static void emit_st(int reg, int32_t disp) {
+    emit_rex(true, reg, RBX);
+    emit1(0x89);
+    emit_env(reg, disp);
+}
+
+// op reg, [rbx + disp]
+static void emit_alu_rm(bool w, int ext, int reg, int32_t disp) {
+    emit_rex(w, reg, RBX);
+    emit1(ext << 3 | 0x3);
+    emit_env(reg, disp);
+}
+
+// op reg, rm on host registers, op is one byte or 0x0f xx
+static void emit_rr(bool w, int op, int reg, int rm) {
+    emit_rex(w, reg, rm);
+    if (op > 0xff) emit1(op >> 8);
+    emit1(op);
+    emit1(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op rax, imm32
+static void emit_alu_ri(bool w, int ext, int32_t imm) {
+    if (w) emit1(0x48);
+    emit1(0x81);
+    emit1(0xc0 | ext << 3 | RAX);
+    emit4(imm);
+}
+
+// op rax, rcx
+static void emit_alu_rr(int ext) {
+    emit_rr(true, ext << 3 | 0x3, RAX, RCX);
+}
+
+static void emit_shift_ri(bool w, int ext, int imm) {
+    if (w) emit1(0x48);
+    emit1(0xc1);
+    emit1(0xc0 | ext << 3 | RAX);
+    emit1(imm);
+}
+
+static void emit_shift_cl(bool w, int ext) {
+    if (w) emit1(0x48);
+    emit1(0xd3);
+    emit1(0xc0 | ext << 3 | RAX);
+}
+
+static void emit_movsxd(void) {
+    emit1(0x48); emit1(0x63); emit1(0xc0);
+}
+
+static void emit_not(int reg) {
+    emit1(0x48); emit1(0xf7); emit1(0xd0 | reg);
+}
+
+static void emit_movi(int reg, uint64_t imm) {
+    emit_rex(true, 0, reg);
+    if ((int64_t)imm == (int32_t)imm) {
+        emit1(0xc7); emit1(0xc0 | (reg & 7));
+        emit4(imm);
+    } else {
+        emit1(0xb8 | (reg & 7));
+        emit8(imm);
+    }
+}
+
+// mov qword [rbx + disp], imm
+static void emit_st_imm(int32_t disp, uint64_t imm) {
+    if ((int64_t)imm == (int32_t)imm) {
+        emit1(0x48); emit1(0xc7);
+        emit_env(0, disp);
+        emit4(imm);
+    } else {
+        emit_movi(RAX, imm);
+        emit_st(RAX, disp);
+    }
+}
+
+// setcc al; movzx eax, al
+static void emit_setcc(int cc) {
+    emit1(0x0f); emit1(0x90 | cc); emit1(0xc0);
+    emit1(0x0f); emit1(0xb6); emit1(0xc0);
+}
+
+// cmovcc rax, reg
+static void emit_cmov(int cc, int reg) {
+    emit1(0x48); emit1(0x0f); emit1(0x40 | cc); emit1(0xc0 | RAX << 3 | reg);
+}
+
+/*
+ * gpr cache, least recently used entries are evicted. Calls clobber the
+ * host registers and handlers use env->gpr, so it is flushed before them.
+ */
+#define JIT_CACHE_REGS 6
+static const int cache_host[JIT_CACHE_REGS] = {RSI, RDI, R8, R9, R10, R11};
+static struct {
+    int gpr;
+    bool dirty;
+    int last_use;
+} cache[JIT_CACHE_REGS];
+static int cache_clock;
+
+static void cache_reset(void) {
+    for (int i = 0; i < JIT_CACHE_REGS; i++) {
+        cache[i].gpr = -1;
+        cache[i].dirty = false;
+        cache[i].last_use = 0;
+    }
+    cache_clock = 0;
+}
+
+static void cache_spill(int i) {
+    if (cache[i].dirty) {
+        emit_st(cache_host[i], GPR_OFF(cache[i].gpr));
+        cache[i].dirty = false;
+    }
+}
+
+static void cache_flush(void) {
+    for (int i = 0; i < JIT_CACHE_REGS; i++) {
+        cache_spill(i);
+    }
+    cache_reset();
+}
+
+static bool cache_empty(void) {
+    for (int i = 0; i < JIT_CACHE_REGS; i++) {
+        if (cache[i].gpr >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// entry of gpr r, loaded from env if asked to
+static int cache_get(int r, bool load) {
+    int e = 0;
+    for (int i = 0; i < JIT_CACHE_REGS; i++) {
+        if (cache[i].gpr == r) {
+            cache[i].last_use = ++ cache_clock;
+            return i;
+        }
+        if (cache[i].last_use < cache[e].last_use) {
+            e = i;
+        }
+    }
+    cache_spill(e);
+    cache[e].gpr = r;
+    cache[e].last_use = ++ cache_clock;
+    if (load) {
+        emit_ld(true, cache_host[e], GPR_OFF(r));
+    }
+    return e;
+}
+
+// host register holding gpr r
+static int gpr_in(int r) {
+    return cache_host[cache_get(r, true)];
+}
+
+// host register to write gpr r to, never r0
+static int gpr_out(int r) {
+    int e = cache_get(r, false);
+    cache[e].dirty = true;
+    return cache_host[e];
+}
+
+static void emit_ld_gpr(int reg, int r) {
+    emit_rr(true, OP_MOV, reg, gpr_in(r));
+}
+
+// 32-bit load, zero extends
+static void emit_ld_gpr_w(int reg, int r) {
+    emit_rr(false, OP_MOV, reg, gpr_in(r));
+}
+
+static void emit_st_gpr(int r) {
+    emit_rr(true, OP_MOV, gpr_out(r), RAX);
+}
+
+// op reg, gpr r
+static void emit_alu_gpr(bool w, int ext, int reg, int r) {
+    emit_rr(w, ext << 3 | 0x3, reg, gpr_in(r));
+}
+
+static void emit_cmp_zero(int r) {
+    int h = gpr_in(r);
+    emit_rr(true, OP_TEST, h, h);
+}
+
+// pc = cond ? taken : fall
+static void emit_branch(int cc, uint64_t taken, uint64_t fall) {
+    emit_movi(RAX, fall);
+    emit_movi(RDX, taken);
+    emit_cmov(cc, RDX);
+    emit_st(RAX, ENV_OFF(pc));
+}
+
+// bring icount up to date
+static void emit_sync(int icount) {
+    if (icount) {
+        emit1(0x48); emit1(0x81);
+        emit_env(ALU_ADD, ENV_OFF(icount));
+        emit4(icount);
+    }
+}
+
+// cmp dword [r12 + disp], imm; jne rel32 (returns the rel32 to patch)
+static uint8_t* emit_check_insn(int32_t disp, uint32_t insn) {
+    emit1(0x41); emit1(0x81); emit1(0xbc); emit1(0x24);
+    emit4(disp);
+    emit4(insn);
+    emit1(0x0f); emit1(0x85);
+    emit4(0);
+    return code - 4;
+}
+
+static void patch_rel32(uint8_t* at, uint8_t* target) {
+    int32_t rel = target - (at + 4);
+    memcpy(at, &rel, 4);
+}
+
+static bool jit_is_branch(int op) {
+    return op >= JIT_BEQ && op <= JIT_JIRL;
+}
+
+static void emit_inline(int op, INSCache* ic, uint64_t pc) {
+    int rd = ic->arg[0], rj = ic->arg[1], rk = ic->arg[2];
+    int imm = ic->arg[2];
+
+    switch (op) {
+    case JIT_ADD_W: case JIT_SUB_W: case JIT_MUL_W:
+    case JIT_ADD_D: case JIT_SUB_D: case JIT_MUL_D:
+    case JIT_AND: case JIT_OR: case JIT_XOR: case JIT_NOR: {
+        if (!rd) return;
+        bool w = !(op == JIT_ADD_W || op == JIT_SUB_W || op == JIT_MUL_W);
+        emit_rr(w, OP_MOV, RAX, gpr_in(rj));
+        if (op == JIT_MUL_W || op == JIT_MUL_D) {
+            emit_rr(w, OP_IMUL, RAX, gpr_in(rk));
+        } else {
+            int ext = (op == JIT_ADD_W || op == JIT_ADD_D) ? ALU_ADD :
+                      (op == JIT_SUB_W || op == JIT_SUB_D) ? ALU_SUB :
+                      op == JIT_AND ? ALU_AND :
+                      op == JIT_XOR ? ALU_XOR : ALU_OR;
+            emit_alu_gpr(w, ext, RAX, rk);
+        }
+        if (op == JIT_NOR) emit_not(RAX);
+        if (!w) emit_movsxd();
+        emit_st_gpr(rd);
+        return;
+    }
+    case JIT_ANDN: case JIT_ORN:
+        if (!rd) return;
+        emit_ld_gpr(RCX, rk);
+        emit_not(RCX);
+        emit_ld_gpr(RAX, rj);
+        emit_alu_rr(op == JIT_ANDN ? ALU_AND : ALU_OR);
+        emit_st_gpr(rd);
+        return;
+    case JIT_SLT: case JIT_SLTU:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        emit_alu_gpr(true, ALU_CMP, RAX, rk);
+        emit_setcc(op == JIT_SLT ? CC_L : CC_B);
+        emit_st_gpr(rd);
+        return;
+    case JIT_MASKEQZ: case JIT_MASKNEZ:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        emit1(0x31); emit1(0xc9);               // xor ecx, ecx
+        emit_cmp_zero(rk);
+        emit_cmov(op == JIT_MASKEQZ ? CC_E : CC_NE, RCX);
+        emit_st_gpr(rd);
+        return;
+    case JIT_SLL_W: case JIT_SRL_W: case JIT_SRA_W:
+    case JIT_SLL_D: case JIT_SRL_D: case JIT_SRA_D: {
+        if (!rd) return;
+        bool w = op >= JIT_SLL_D;
+        int ext = (op == JIT_SLL_W || op == JIT_SLL_D) ? SH_SHL :
+                  (op == JIT_SRL_W || op == JIT_SRL_D) ? SH_SHR : SH_SAR;
+        // x86 masks cl to 5 or 6 bits like the interpreter does
+        emit_rr(w, OP_MOV, RAX, gpr_in(rj));
+        emit_ld_gpr(RCX, rk);
+        emit_shift_cl(w, ext);
+        if (!w) emit_movsxd();
+        emit_st_gpr(rd);
+        return;
+    }
+    case JIT_ADDI_W:
+        if (!rd) return;
+        emit_ld_gpr_w(RAX, rj);
+        emit_alu_ri(false, ALU_ADD, imm);
+        emit_movsxd();
+        emit_st_gpr(rd);
+        return;
+    case JIT_ADDI_D: case JIT_ADDU16I_D: case JIT_ANDI: case JIT_ORI: case JIT_XORI:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        if (op == JIT_ADDI_D) emit_alu_ri(true, ALU_ADD, imm);
+        if (op == JIT_ADDU16I_D) emit_alu_ri(true, ALU_ADD, imm << 16);
+        if (op == JIT_ANDI) emit_alu_ri(true, ALU_AND, imm);
+        if (op == JIT_ORI) emit_alu_ri(true, ALU_OR, imm);
+        if (op == JIT_XORI) emit_alu_ri(true, ALU_XOR, imm);
+        emit_st_gpr(rd);
+        return;
+    case JIT_SLTI: case JIT_SLTUI:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        emit_alu_ri(true, ALU_CMP, imm);
+        emit_setcc(op == JIT_SLTI ? CC_L : CC_B);
+        emit_st_gpr(rd);
+        return;
+    case JIT_SLLI_W: case JIT_SRLI_W: case JIT_SRAI_W:
+        if (!rd) return;
+        emit_ld_gpr_w(RAX, rj);
+        emit_shift_ri(false, op == JIT_SLLI_W ? SH_SHL : op == JIT_SRLI_W ? SH_SHR : SH_SAR, imm);
+        // srli.w result is zero extended in trans_srli_w
+        if (op != JIT_SRLI_W) emit_movsxd();
+        emit_st_gpr(rd);
+        return;
+    case JIT_SLLI_D: case JIT_SRLI_D: case JIT_SRAI_D:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        emit_shift_ri(true, op == JIT_SLLI_D ? SH_SHL : op == JIT_SRLI_D ? SH_SHR : SH_SAR, imm);
+        emit_st_gpr(rd);
+        return;
+    case JIT_LU12I_W:
+        if (!rd) return;
+        emit_movi(gpr_out(rd), (int64_t)(ic->arg[1] << 12));
+        return;
+    case JIT_LU32I_D:
+        if (!rd) return;
+        emit_ld_gpr_w(RAX, rd);
+        emit_movi(RCX, (int64_t)ic->arg[1] << 32);
+        emit_alu_rr(ALU_OR);
+        emit_st_gpr(rd);
+        return;
+    case JIT_LU52I_D:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        emit_movi(RCX, MAKE_64BIT_MASK(0, 52));
+        emit_alu_rr(ALU_AND);
+        emit_movi(RCX, deposit64(0, 52, 12, imm));
+        emit_alu_rr(ALU_OR);
+        emit_st_gpr(rd);
+        return;
+    case JIT_PCADDI:
+        if (!rd) return;
+        emit_movi(gpr_out(rd), pc + (ic->arg[1] << 2));
+        return;
+    case JIT_PCADDU12I:
+        if (!rd) return;
+        emit_movi(gpr_out(rd), pc + (ic->arg[1] << 12));
+        return;
+    case JIT_PCALAU12I:
+        if (!rd) return;
+        emit_movi(gpr_out(rd), (pc + (ic->arg[1] << 12)) & ~0xfffull);
+        return;
+    case JIT_EXT_W_B: case JIT_EXT_W_H:
+        if (!rd) return;
+        emit_rr(true, op == JIT_EXT_W_B ? OP_MOVSXB : OP_MOVSXW, RAX, gpr_in(rj));
+        emit_st_gpr(rd);
+        return;
+    case JIT_ALSL_D:
+        if (!rd) return;
+        emit_ld_gpr(RAX, rj);
+        emit_shift_ri(true, SH_SHL, ic->arg[3]);
+        emit_alu_gpr(true, ALU_ADD, RAX, rk);
+        emit_st_gpr(rd);
+        return;
+    case JIT_BEQ: case JIT_BNE: case JIT_BLT: case JIT_BGE: case JIT_BLTU: case JIT_BGEU: {
+        // arg_rr_offs: rj, rd, offs
+        int cc = op == JIT_BEQ ? CC_E : op == JIT_BNE ? CC_NE : op == JIT_BLT ? CC_L :
+                 op == JIT_BGE ? CC_GE : op == JIT_BLTU ? CC_B : CC_AE;
+        emit_ld_gpr(RCX, ic->arg[0]);
+        emit_alu_gpr(true, ALU_CMP, RCX, ic->arg[1]);
+        emit_branch(cc, pc + ic->arg[2], pc + 4);
+        return;
+    }
+    case JIT_BEQZ: case JIT_BNEZ:
+        // arg_r_offs: rj, offs
+        emit_cmp_zero(ic->arg[0]);
+        emit_branch(op == JIT_BEQZ ? CC_E : CC_NE, pc + ic->arg[1], pc + 4);
+        return;
+    case JIT_B:
+        emit_st_imm(ENV_OFF(pc), pc + ic->arg[0]);
+        return;
+    case JIT_BL:
+        emit_movi(gpr_out(1), pc + 4);
+        emit_st_imm(ENV_OFF(pc), pc + ic->arg[0]);
+        return;
+    case JIT_JIRL:
+        emit_ld_gpr(RAX, rj);
+        emit_alu_ri(true, ALU_ADD, ic->arg[2]);
+        emit_st(RAX, ENV_OFF(pc));
+        if (rd) {
+            emit_movi(gpr_out(rd), pc + 4);
+        }
+        return;
+    default:
+        lsassert(0);
+    }
+}
+
+static void jit_flush(CPULoongArchState *env) {
+    // blocks count up to JIT_HOT_COUNT again and get recompiled
+    for (int i = 0; i < TB_NUM; i++) {
+        env->tbcache[i].jit_code = NULL;
+        env->tbcache[i].exec_count = 0;
+    }
+    jit_ptr = jit_buffer;
+    env->jit_flush_count ++;
+}
+
+JitFunc jit_compile(CPULoongArchState *env, TBCache* tb) {
+    int ops[TB_MAX_INSNS];
+    // side exits: jump to patch, instructions done, icount still to add
+    struct {
+        uint8_t* at;
+        int done;
+        int icount;
+    } exits[TB_MAX_INSNS * 2];
+    int nexit = 0;
+    int n = tb->n;
+
+    if (jit_disabled) {
+        return NULL;
+    }
+    if (!jit_buffer) {
+        jit_buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit_buffer == MAP_FAILED) {
+            fprintf(stderr, "jit: can not map code buffer, running without jit\n");
+            jit_buffer = NULL;
+            jit_disabled = true;
+            return NULL;
+        }
+        jit_ptr = jit_buffer;
+    }
+    if (jit_buffer + JIT_BUFFER_SIZE - jit_ptr < JIT_BLOCK_MAX_SIZE) {
+        jit_flush(env);
+    }
+
+    for (int i = 0; i < n; i++) {
+        ops[i] = interpreter_jit_op(&tb->insns[i]);
+        // b 0 exits the emulator in trans_b
+        if (ops[i] == JIT_B && tb->insns[i].arg[0] == 0) {
+            ops[i] = JIT_CALL;
+        }
+    }
+
+    code = jit_ptr;
+    uint8_t* start = code;
+
+    // push rbx; push r12; sub rsp, 8; mov rbx, rdi; mov r12, host address of block
+    emit1(0x53); emit1(0x41); emit1(0x54);
+    emit1(0x48); emit1(0x83); emit1(0xec); emit1(0x08);
+    emit1(0x48); emit1(0x89); emit1(0xfb);
+#if defined(CONFIG_USER_ONLY)
+    uint64_t host = tb->pa;
+#else
+    uint64_t host = (uint64_t)(ram + tb->pa);
+#endif
+    emit1(0x49); emit1(0xbc); emit8(host);
+    cache_reset();
+
+    // instructions whose icount is already in env, see tb_exec
+    int icount_done = 0;
+    for (int i = 0; i < n; i++) {
+        INSCache* ic = &tb->insns[i];
+        uint64_t pc = tb->pc + i * 4;
+
+        // memory only changes in called handlers, check the words up to the next call
+        if (i == 0 || ops[i - 1] == JIT_CALL) {
+            // side exits leave env as is, nothing may be cached yet
+            lsassert(cache_empty());
+            for (int j = i; j < n; j++) {
+                exits[nexit].at = emit_check_insn(j * 4, tb->insns[j].insn);
+                exits[nexit].done = i;
+                exits[nexit++].icount = i - icount_done;
+                if (ops[j] == JIT_CALL) {
+                    break;
+                }
+            }
+        }
+
+        if (ops[i] == JIT_CALL) {
+            cache_flush();
+            emit_sync(i - icount_done);
+            emit_st_imm(ENV_OFF(pc), pc);
+            emit1(0x48); emit1(0x89); emit1(0xdf);     // mov rdi, rbx
+            emit1(0x48); emit1(0xbe); emit8((uint64_t)ic->arg);
+            emit_movi(RAX, (uint64_t)ic->trans_func);
+            emit1(0xff); emit1(0xd0);                 // call rax
+            emit_st_imm(GPR_OFF(0), 0);
+            // icount of the call itself is added by the next sync
+            icount_done = i;
+            // an illegal instruction leaves pc alone, let the interpreter see it
+            if (i != n - 1) {
+                emit_movi(RAX, pc + 4);
+                emit_alu_rm(true, ALU_CMP, RAX, ENV_OFF(pc));
+                emit1(0x0f); emit1(0x85); emit4(0);
+                exits[nexit].at = code - 4;
+                exits[nexit].done = i + 1;
+                exits[nexit++].icount = i + 1 - icount_done;
+            }
+        } else {
+            emit_inline(ops[i], ic, pc);
+        }
+    }
+    cache_flush();
+    if (ops[n - 1] != JIT_CALL && !jit_is_branch(ops[n - 1])) {
+        emit_st_imm(ENV_OFF(pc), tb->pc + n * 4);
+    }
+    emit_sync(n - icount_done);
+    emit1(0xb8); emit4(n);                            // mov eax, n
+
+    uint8_t* epilogue = code;
+    emit1(0x48); emit1(0x83); emit1(0xc4); emit1(0x08);
+    emit1(0x41); emit1(0x5c); emit1(0x5b);
+    emit1(0xc3);
+
+    // env is up to date at every side exit except icount of a finished call
+    for (int e = 0; e < nexit; e++) {
+        patch_rel32(exits[e].at, code);
+        emit_sync(exits[e].icount);
+        emit1(0xb8); emit4(exits[e].done);
+        emit1(0xe9); emit4(0);
+        patch_rel32(code - 4, epilogue);
+    }
+
+    lsassert(code - start <= JIT_BLOCK_MAX_SIZE);
+    jit_ptr = code;
+    env->jit_block_count ++;
+    return (JitFunc)start;
+}
+
+#else
+
+JitFunc jit_compile(CPULoongArchState *env, TBCache* tb) {
+    return NULL;
+}
+
+#endif
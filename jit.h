@@ -0,0 +1,52 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdio.h>
+#include "cpu.h"
+
+// a TBCache entry is compiled after it has been executed this many times,
+// difftest steps are compiled at once
+#if defined(CONFIG_DIFF)
+#define JIT_HOT_COUNT 1
+#else
+#define JIT_HOT_COUNT 16
+#endif
+
+#define JIT_BUFFER_SIZE (64 << 20)
+#define JIT_BLOCK_MAX_SIZE (16 << 10)
+
+// trans_* handlers the JIT emits inline code for, everything else is called
+#define JIT_OP_LIST(F) \
+    F(ADD_W, add_w) F(ADD_D, add_d) F(SUB_W, sub_w) F(SUB_D, sub_d) \
+    F(AND, and) F(OR, or) F(XOR, xor) F(NOR, nor) F(ANDN, andn) F(ORN, orn) \
+    F(SLT, slt) F(SLTU, sltu) F(MUL_W, mul_w) F(MUL_D, mul_d) \
+    F(MASKEQZ, maskeqz) F(MASKNEZ, masknez) \
+    F(SLL_W, sll_w) F(SRL_W, srl_w) F(SRA_W, sra_w) \
+    F(SLL_D, sll_d) F(SRL_D, srl_d) F(SRA_D, sra_d) \
+    F(ADDI_W, addi_w) F(ADDI_D, addi_d) F(ADDU16I_D, addu16i_d) \
+    F(ANDI, andi) F(ORI, ori) F(XORI, xori) F(SLTI, slti) F(SLTUI, sltui) \
+    F(SLLI_W, slli_w) F(SRLI_W, srli_w) F(SRAI_W, srai_w) \
+    F(SLLI_D, slli_d) F(SRLI_D, srli_d) F(SRAI_D, srai_d) \
+    F(LU12I_W, lu12i_w) F(LU32I_D, lu32i_d) F(LU52I_D, lu52i_d) \
+    F(PCADDI, pcaddi) F(PCADDU12I, pcaddu12i) F(PCALAU12I, pcalau12i) \
+    F(EXT_W_B, ext_w_b) F(EXT_W_H, ext_w_h) F(ALSL_D, alsl_d) \
+    F(BEQ, beq) F(BNE, bne) F(BLT, blt) F(BGE, bge) F(BLTU, bltu) F(BGEU, bgeu) \
+    F(BEQZ, beqz) F(BNEZ, bnez) F(B, b) F(BL, bl) F(JIRL, jirl)
+
+enum JitOp {
+    JIT_CALL = 0,
+#define JIT_OP_ENUM(op, name) JIT_##op,
+    JIT_OP_LIST(JIT_OP_ENUM)
+#undef JIT_OP_ENUM
+};
+
+/*
+ * Host code of a block. Returns the number of guest instructions executed,
+ * less than tb->n if guest code was modified under the block.
+ */
+typedef int (*JitFunc)(CPULoongArchState *env);
+
+int interpreter_jit_op(INSCache* ic);
+JitFunc jit_compile(CPULoongArchState *env, TBCache* tb);
+
+#endif
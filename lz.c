@@ -0,0 +1,179 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 14
+// as lz4, the last match ends 5 bytes and starts 12 bytes before the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+// skip faster through data that does not compress
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t lz_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t* lz_put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t* lz_put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* lit, size_t lit_len,
+                                size_t off, size_t match_len, bool last) {
+    if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > oend) {
+        return NULL;
+    }
+    uint8_t* token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) {
+        op = lz_put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (last) {
+        return op;
+    }
+    *op++ = off;
+    *op++ = off >> 8;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) {
+        op = lz_put_length(op, match_len - 15);
+    }
+    return op;
+}
+
+int64_t lz_compress(const void* src, size_t n, void* dst, size_t cap) {
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + n;
+    uint8_t* op = dst;
+    uint8_t* oend = op + cap;
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    if (n > LZ_MFLIMIT) {
+        const uint8_t* mflimit = end - LZ_MFLIMIT;
+        const uint8_t* matchlimit = end - LZ_LAST_LITERALS;
+        unsigned misses = 0;
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t* ref = base + table[h];
+            table[h] = ip - base;
+            if (ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                ip += (misses++ >> LZ_SKIP_TRIGGER) + 1;
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* m = ip + LZ_MIN_MATCH;
+            const uint8_t* r = ref + LZ_MIN_MATCH;
+            while (m + 8 <= matchlimit) {
+                uint64_t diff = lz_read64(m) ^ lz_read64(r);
+                if (diff) {
+                    m += __builtin_ctzll(diff) >> 3;
+                    goto found;
+                }
+                m += 8;
+                r += 8;
+            }
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+        found:
+            op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip - LZ_MIN_MATCH, false);
+            if (!op) {
+                return -1;
+            }
+            ip = anchor = m;
+        }
+    }
+    op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0, true);
+    if (!op) {
+        return -1;
+    }
+    return op - (uint8_t*)dst;
+}
+
+static inline bool lz_get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+int64_t lz_decompress(const void* src, size_t n, void* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = ip + n;
+    uint8_t* op = dst;
+    uint8_t* oend = op + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(&ip, iend, &lit_len)) {
+            return -1;
+        }
+        if (lit_len > iend - ip || lit_len > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend) {
+            break;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz_get_length(&ip, iend, &match_len)) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (off == 0 || off > op - (uint8_t*)dst || match_len > oend - op) {
+            return -1;
+        }
+        // an overlapping match repeats the pattern, double it each copy
+        const uint8_t* ref = op - off;
+        while (match_len) {
+            size_t len = op - ref < match_len ? op - ref : match_len;
+            memcpy(op, ref, len);
+            op += len;
+            match_len -= len;
+        }
+    }
+    return op - (uint8_t*)dst;
+}
@@ -0,0 +1,21 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A small LZ77 block codec in the LZ4 block layout: sequences of a token
+ * (literal length << 4 | match length - 4), literals, a 16 bit little endian
+ * offset, with 255-continued lengths. Each block is independent.
+ */
+
+// worst case size of compressing n bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// return the compressed size, or -1 if it does not fit in cap
+int64_t lz_compress(const void* src, size_t n, void* dst, size_t cap);
+// return the decompressed size, or -1 if src is malformed or dst is too small
+int64_t lz_decompress(const void* src, size_t n, void* dst, size_t cap);
+
+#endif
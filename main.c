@@ -9,6 +9,8 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
 #include <getopt.h>
 
 #include <elf.h>
@@ -26,10 +28,14 @@
 #include "irq.h"
 #include "serial.h"
 #include "serial_plus.h"
+#include "mmio.h"
 #endif
 #if defined(CONFIG_PLUGIN)
 #include <dlfcn.h>
 #endif
+#if defined(CONFIG_JIT)
+#include "jit.h"
+#endif
 
 #if defined(CONFIG_PLUGIN)
 la_emu_plugin_ops* plugin_ops;
@@ -58,6 +64,13 @@ extern void show_register_fpr(CPULoongArchState *env);
 extern void set_fetch_breakpoint(int idx, target_long pc);
 extern void restore_checkpoint(CPULoongArchState *env, char* image_dir);
 extern void restore_checkpoint_qemu_format(CPULoongArchState *env, char* mem_path, char* cpu_path);
+extern void compact_checkpoint(char* image_dir);
+extern bool ckpt_delta;
+extern bool ckpt_lz;
+extern char* ckpt_store;
+extern bool ckpt_lazy;
+extern void ckpt_lazy_finish(void);
+extern void ckpt_writers_forget(void);
 
 // # define ELF_CLASS  ELFCLASS64
 
@@ -81,6 +94,7 @@ static void sigaction_entry_timer(int signal, siginfo_t *si, void *arg) {
     if (id==current_env->timerid) {
         qemu_log_mask(CPU_LOG_TIMER, "TIMER alarmed, icount:%ld\n", current_env->icount);
         current_env->timer_int = true;
+        current_env->irq_pending = true;
     } else {
         fprintf(stderr, "TIMER, it's somebody else!\n");
     }
@@ -92,6 +106,7 @@ static void sigaction_entry_serial_timer(int signal, siginfo_t *si, void *arg) {
     if (id==serial_timerid) {
         qemu_log_mask(CPU_LOG_TIMER, "SERIAL TIMER alarmed, icount:%ld\n", current_env->icount);
         serial_timer_int = true;
+        current_env->irq_pending = true;
     } else {
         fprintf(stderr, "TIMER, it's somebody else!\n");
     }
@@ -177,6 +192,7 @@ char real_kernel_cmdline[0x1000];
 // for checkpoint restore
 char* ckpt_mem_filename;
 char* ckpt_cpu_filename;
+char* ckpt_compact_dir;
 char* cpu_option;
 
 #if !defined (CONFIG_USER_ONLY) && !defined (CONFIG_DIFF)
@@ -204,6 +220,7 @@ void usage(void) {
     fprintf(stderr, "-k Kernel vmlinux or checkpoint directory(kernel mode)\n");
 #else
     fprintf(stderr, "usage: la_emu_user [-d exec,cpu,page,strace,unimp] [-D logfile] program [arguments...]\n");
+    fprintf(stderr, "       la_emu_user [options] -k checkpoint directory\n");
 #endif
     fprintf(stderr, "-d Log info, support: exec,cpu,fpu,int\n");
     fprintf(stderr, "-D Log file\n");
@@ -211,13 +228,107 @@ void usage(void) {
     fprintf(stderr, "-z Determined events\n");
     fprintf(stderr, "-g Enable gdbserver\n");
     fprintf(stderr, "-w Force enable hardware page table walker\n");
+#ifndef CONFIG_USER_ONLY
+    fprintf(stderr, "--tlbc entries[,ways] Soft tlb size, default %d,%dway\n", TC_NUM, TC_WAYS);
+    fprintf(stderr, "--hugepage thp|hugetlb|dir Back guest ram with transparent huge pages, 2MB memfd or hugetlbfs dir\n");
+    fprintf(stderr, "--memfd Back guest ram with a memfd\n");
+    fprintf(stderr, "--ckpt-delta Save checkpoints as the pages changed since the previous one\n");
+    fprintf(stderr, "--ckpt-lz Save checkpoints compressed, on all host cores\n");
+    fprintf(stderr, "--ckpt-store dir Save checkpoints as manifests of pages kept once in dir\n");
+    fprintf(stderr, "--ckpt-lazy Restore mem.lz or --ckpt-mem checkpoints as guest pages are touched\n");
+    fprintf(stderr, "--ckpt-compact dir Fold a delta checkpoint chain into a standalone checkpoint\n");
+    fprintf(stderr, "--clone n Run n copy-on-write clones of the guest, also by writing n to %#x\n", CLONE_BASE);
+#else
+    fprintf(stderr, "--hugepage thp Back guest stack with transparent huge pages\n");
+#endif
     laemu_exit(EXIT_SUCCESS);
 }
 
+#ifndef CONFIG_DIFF
+// host memory backing guest RAM, see --hugepage
+enum {
+    HUGEPAGE_NONE,
+    HUGEPAGE_THP,       // madvise(MADV_HUGEPAGE) anonymous memory
+    HUGEPAGE_HUGETLB,   // 2MB pages of a hugetlbfs file or memfd
+};
+static int hugepage_mode = HUGEPAGE_NONE;
+#if !defined (CONFIG_USER_ONLY)
+static const char* hugetlbfs_dir;
+#endif
+// host range covered by the huge page report
+static void* hugepage_begin;
+static void* hugepage_end;
+
+static void handle_hugepage(const char* arg) {
+    if (strcmp(arg, "thp") == 0) {
+        hugepage_mode = HUGEPAGE_THP;
+#if !defined (CONFIG_USER_ONLY)
+    } else if (strcmp(arg, "hugetlb") == 0) {
+        hugepage_mode = HUGEPAGE_HUGETLB;
+    } else if (is_directory(arg)) {
+        hugepage_mode = HUGEPAGE_HUGETLB;
+        hugetlbfs_dir = arg;
+#endif
+    } else {
+#if !defined (CONFIG_USER_ONLY)
+        fprintf(stderr, "unknown --hugepage %s, support: thp,hugetlb,<hugetlbfs dir>\n", arg);
+#else
+        fprintf(stderr, "unknown --hugepage %s, support: thp\n", arg);
+#endif
+        laemu_exit(EXIT_FAILURE);
+    }
+}
+
+static void hugepage_advise(void* start, uint64_t size) {
+    if (hugepage_mode == HUGEPAGE_THP && madvise(start, size, MADV_HUGEPAGE)) {
+        fprintf(stderr, "madvise(MADV_HUGEPAGE) failed, error:%s\n", strerror(errno));
+    }
+}
+
+// huge page backed part of the resident memory in [hugepage_begin, hugepage_end)
+static void hugepage_report(const char* when) {
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return;
+    }
+    char line[256];
+    char key[64];
+    uint64_t lo, hi, kb;
+    uint64_t rss = 0, huge = 0;
+    bool in_range = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            in_range = lo < (uint64_t)hugepage_end && hi > (uint64_t)hugepage_begin;
+        } else if (in_range && sscanf(line, "%63[^:]: %lu kB", key, &kb) == 2) {
+            if (strcmp(key, "Rss") == 0) {
+                rss += kb;
+            } else if (strcmp(key, "AnonHugePages") == 0 || strcmp(key, "ShmemPmdMapped") == 0) {
+                huge += kb;
+            } else if (strcmp(key, "Shared_Hugetlb") == 0 || strcmp(key, "Private_Hugetlb") == 0) {
+                // hugetlb pages are not part of Rss
+                rss += kb;
+                huge += kb;
+            }
+        }
+    }
+    fclose(f);
+    fprintf(stderr, "hugepage %s: rss:%ldkB huge:%ldkB coverage:%.1f%%\n",
+            when, rss, huge, rss ? huge * 100.0 / rss : 0.0);
+}
+
+static void hugepage_report_exit(void) {
+    hugepage_report("exit");
+}
+#endif
+
 #if defined(CONFIG_USER_ONLY)
 static target_ulong user_setup_stack() {
     void* dst = mmap(NULL, SZ_4G, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     lsassert(dst != MAP_FAILED);
+    hugepage_advise(dst, SZ_4G);
+    hugepage_begin = dst;
+    hugepage_end = dst + SZ_4G;
+    guest_region_add((abi_ulong)dst, SZ_4G, PROT_READ | PROT_WRITE, true);
     return (target_ulong)(dst + SZ_4G - 64);
 }
 #endif
@@ -226,16 +337,71 @@ static target_ulong user_setup_stack() {
 #define elf_shdr Elf64_Shdr
 #define elf_phdr Elf64_Phdr
 #if !defined (CONFIG_USER_ONLY) && !defined (CONFIG_DIFF)
+// file offsets of the RAM parts when backed by ram_fd
+#define RAM_FILE_PART1 0
+#define RAM_FILE_PART3 SZ_256M
+#define RAM_FILE_PART2 (SZ_256M + SZ_32M)
+
+// file backing guest RAM, -1 for private anonymous memory
+int ram_fd = -1;
+// --memfd, keep guest RAM in a memfd even without hugetlb
+static bool ram_memfd;
+
+static int open_ram_file(uint64_t size) {
+    int fd;
+    if (hugetlbfs_dir) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/la_emu_ram.XXXXXX", hugetlbfs_dir);
+        fd = mkstemp(path);
+        lsassertm(fd >= 0, "can not create %s, error:%s\n", path, strerror(errno));
+        unlink(path);
+    } else {
+        unsigned flags = MFD_CLOEXEC;
+        if (hugepage_mode == HUGEPAGE_HUGETLB) {
+            flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+        }
+        fd = syscall(__NR_memfd_create, "la_emu_ram", flags);
+        lsassertm(fd >= 0, "memfd_create failed, error:%s\n", strerror(errno));
+    }
+    lsassertm(ftruncate(fd, size) == 0, "can not reserve %ldMB for ram, error:%s\n", size >> 20, strerror(errno));
+    return fd;
+}
+
+static void map_ram_part(void* addr, uint64_t size, uint64_t offset, int flags) {
+    void* p;
+    if (ram_fd >= 0) {
+        p = mmap(addr, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, ram_fd, offset);
+    } else {
+        p = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+    lsassertm(p != MAP_FAILED, "map ram failed, error:%s%s\n", strerror(errno),
+              hugepage_mode == HUGEPAGE_HUGETLB ? ", check /proc/sys/vm/nr_hugepages" : "");
+    hugepage_advise(p, size);
+}
+
+// flags is MAP_SHARED or MAP_PRIVATE (| MAP_NORESERVE) when ram is backed by ram_fd
+static void map_ram(char* start, int flags) {
+    map_ram_part(start, SZ_256M, RAM_FILE_PART1, flags);
+    map_ram_part(start + SZ_2G + SZ_256M, ram_size - SZ_256M, RAM_FILE_PART2, flags);
+    map_ram_part(start + 0x1c000000, SZ_32M, RAM_FILE_PART3, flags);
+}
+
 static char* alloc_ram(uint64_t ram_size) {
-    void* start = mmap(NULL, ram_size + SZ_2G, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // align the parts to huge pages
+    char* start = mmap(NULL, ram_size + SZ_2G + SZ_2M, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     lsassert(start != MAP_FAILED);
-    void* part1 = mmap(start, SZ_256M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    lsassert(part1 != MAP_FAILED);
-    void* part2 = mmap(start + SZ_2G + SZ_256M, ram_size - SZ_256M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    lsassert(part2 != MAP_FAILED);
-    void* part3 = mmap(start + 0x1c000000, SZ_32M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    lsassert(part3 != MAP_FAILED);
-    return part1;
+    start = (char*)ROUND_UP((uint64_t)start, SZ_2M);
+    if (hugepage_mode == HUGEPAGE_HUGETLB) {
+        lsassertm((ram_size & (SZ_2M - 1)) == 0, "ram size should be a multiple of 2MB\n");
+    }
+    if (hugepage_mode == HUGEPAGE_HUGETLB || ram_memfd) {
+        ram_fd = open_ram_file(RAM_FILE_PART2 + ram_size - SZ_256M);
+    }
+    map_ram(start, MAP_SHARED);
+    ram_dirty_init(ram_size + SZ_2G);
+    hugepage_begin = start;
+    hugepage_end = start + ram_size + SZ_2G;
+    return start;
 }
 
 bool addr_in_ram(hwaddr pa) {
@@ -255,6 +421,7 @@ bool addr_range_in_ram(hwaddr begin, hwaddr end) {
 void ram_copy_bytes(hwaddr pa, void* src, size_t size) {
     lsassertm(addr_range_in_ram(pa, pa + size), "copy to ram addr:%lx, size:%lx failed\n", pa, size);
     memcpy(ram + pa, src , size);
+    ram_set_dirty_range(pa, size);
 }
 
 bool load_elf(const char* filename, uint64_t* entry_addr) {
@@ -313,6 +480,7 @@ bool load_elf(const char* filename, uint64_t* entry_addr) {
                 }
                 // ram_writen(ph->p_paddr & 0xfffffff, data, file_size);
                 memcpy(ram + (ph->p_paddr & 0xffffffffffff), data, file_size);
+                ram_set_dirty_range(ph->p_paddr & 0xffffffffffff, file_size);
                 kernel_addr_low = MIN(kernel_addr_low, ph->p_paddr & 0xffffffffffff);
                 kernel_addr_high = MAX(kernel_addr_high, kernel_addr_low + mem_size);
                 qemu_log_mask(CPU_LOG_PAGE, "%lx, file_size:%lx mem_size:%lx, \n", ph->p_paddr, file_size, mem_size);
@@ -413,6 +581,7 @@ bool load_elf_user(const char* filename, uint64_t* entry_addr) {
     if ((void*)load_addr == MAP_FAILED) {
         lsassert(0);
     }
+    guest_region_add(load_addr, (size_t)hiaddr - loaddr + 1, PROT_NONE, true);
 
     abi_ulong load_bias = load_addr - loaddr;
     info.load_bias = load_bias;
@@ -461,6 +630,7 @@ bool load_elf_user(const char* filename, uint64_t* entry_addr) {
                                     elf_prot, MAP_PRIVATE | MAP_FIXED,
                                     fd, ph->p_offset - vaddr_po);
                 lsassert(r != MAP_FAILED);
+                guest_region_add(vaddr_ps, ph->p_filesz + vaddr_po, elf_prot, false);
             }
             if (vaddr_ef < vaddr_em) {
                 uint64_t end = vaddr_ps + ph->p_filesz + vaddr_po;
@@ -471,6 +641,7 @@ bool load_elf_user(const char* filename, uint64_t* entry_addr) {
                     void* r = mmap((void*)align_bss, end_bss - align_bss,
                             elf_prot, MAP_FIXED | MAP_PRIVATE | MAP_ANON, -1, 0);
                     lsassert(r != MAP_FAILED);
+                    guest_region_add(align_bss, end_bss - align_bss, elf_prot, true);
                 }
             }
             /* Find the full program boundaries.  */
@@ -551,6 +722,8 @@ void cpu_reset(CPUState* cs) {
 #ifndef CONFIG_USER_ONLY
     env->pc = 0x1c000000;
     memset(env->tlb, 0, sizeof(env->tlb));
+    loongarch_tlb_index_reset(env);
+    cpu_dmw_refresh(env);
     // if (kvm_enabled()) {
     //     kvm_arch_reset_vcpu(env);
     // }
@@ -657,6 +830,9 @@ static void loongarch_cpu_do_interrupt(CPUState *cs)
 
     env->CSR_CRMD = FIELD_DP64(env->CSR_CRMD, CSR_CRMD, PLV, 0);
     env->CSR_CRMD = FIELD_DP64(env->CSR_CRMD, CSR_CRMD, IE, 0);
+#ifndef CONFIG_USER_ONLY
+    cpu_dmw_refresh(env);
+#endif
 
     if (vec_size) {
         vec_size = (1 << vec_size) * 4;
@@ -716,43 +892,400 @@ void loongarch_cpu_set_irq(void *opaque, int irq, int level)
     }
 
     env->CSR_ESTAT = deposit64(env->CSR_ESTAT, irq, 1, level != 0);
+    if (level) {
+        env->irq_pending = true;
+    }
 }
 
-static uint32_t fetch(CPULoongArchState *env, INSCache** ic) {
+static hwaddr fetch_pa(CPULoongArchState *env) {
 #if defined(CONFIG_USER_ONLY)
-        uint32_t insn = ram_lduw(env->pc);
-        *ic = cpu_get_ic(env, insn);
-        return insn;
-
+    return env->pc;
 #else
-    int insn;
     hwaddr ha;
     int prot;
     uint64_t addr = env->pc;
-    int tc_index = TC_INDEX(addr);
-    TLBCache* tc = env->tc_fetch + tc_index;
+    if (cpu_dmw_hit(env, addr)) {
+        env->dmw_hit_count ++;
+        return addr & env->dmw_pa_mask;
+    }
     uint64_t page_addr = addr & TARGET_PAGE_MASK;
-    if (likely(page_addr == tc->va)) {
+    uint64_t tag = cpu_tc_tag(env);
+    TLBCache* tc = cpu_tc_find(env, env->tc_fetch, page_addr, tag);
+    TLBCacheHuge* huge;
+    if (likely(tc)) {
         ha = (addr & (TARGET_PAGE_SIZE - 1)) | tc->pa;
+    } else if ((huge = cpu_tc_huge_find(env, env->tc_fetch, MMU_INST_FETCH, addr, tag))) {
+        ha = (addr & ~huge->mask) | huge->pa;
     } else {
         int mmu_idx = FIELD_EX64(env->CSR_CRMD, CSR_CRMD, PLV) == 0 ? MMU_KERNEL_IDX : MMU_USER_IDX;
         check_get_physical_address(env, &ha, &prot, addr, MMU_INST_FETCH, mmu_idx);
         // fprintf(stderr, "va:%lx,pa:%lx\n", addr, ha);
-        tc->va = page_addr;
-        tc->pa = ha & TARGET_PAGE_MASK;
+        cpu_tc_fill_page(env, env->tc_fetch, MMU_INST_FETCH, addr, tag, ha);
+    }
+    return ha;
+#endif
+}
+
+#if !defined(CONFIG_USER_ONLY)
+unsigned long* ram_dirty;
+unsigned long* ram_used;
+uint64_t ram_pages;
+
+// size covers every pa of ram, holes included
+void ram_dirty_init(uint64_t size) {
+    ram_pages = size >> TARGET_PAGE_BITS;
+    ram_dirty = calloc(BITS_TO_LONGS(ram_pages), sizeof(unsigned long));
+    ram_used = calloc(BITS_TO_LONGS(ram_pages), sizeof(unsigned long));
+    lsassert(ram_dirty && ram_used);
+}
+
+// for writes to ram that do not come from guest stores
+void ram_set_dirty_range(hwaddr pa, uint64_t size) {
+    for (hwaddr page = pa & TARGET_PAGE_MASK; page < pa + size; page += TARGET_PAGE_SIZE) {
+        ram_set_dirty(page);
     }
-    insn = ram_lduw(ha);
+}
+
+// start a new dirty interval, the store tc entries need TC_FLAG_NOTDIRTY again
+void ram_dirty_reset(CPULoongArchState *env) {
+    memset(ram_dirty, 0, BITS_TO_LONGS(ram_pages) * sizeof(unsigned long));
+    cpu_clear_tc(env);
+}
+
+int tc_ways = TC_WAYS;
+uint64_t tc_set_mask = TC_NUM / TC_WAYS - 1;
+
+void cpu_tc_init(CPULoongArchState *env) {
+    size_t size = (tc_set_mask + 1) * tc_ways * sizeof(TLBCache);
+    env->tc_load = malloc(size);
+    env->tc_store = malloc(size);
+    env->tc_fetch = malloc(size);
+    lsassert(env->tc_load && env->tc_store && env->tc_fetch);
+    memset(env->tc_load, -1, size);
+    memset(env->tc_store, -1, size);
+    memset(env->tc_fetch, -1, size);
+    memset(env->tc_huge, -1, sizeof(env->tc_huge));
+}
+
+// look at the other ways of a set, a hit is moved to the front
+TLBCache* cpu_tc_find_slow(CPULoongArchState *env, TLBCache* set, uint64_t page_addr, uint64_t tag) {
+    for (int i = 1; i < tc_ways; i++) {
+        if ((set[i].va & ~TC_FLAGS) == page_addr && set[i].tag == tag) {
+            TLBCache hit = set[i];
+            memmove(set + 1, set, i * sizeof(TLBCache));
+            set[0] = hit;
+            env->tc_hit_count ++;
+            return set;
+        }
+    }
+    env->tc_miss_count ++;
+    return NULL;
+}
+
+// pages are classified once here, a ram page hit is a single host access
+void cpu_tc_fill(TLBCache* tc, uint64_t page_addr, uint64_t tag, uint64_t pa) {
+    TLBCache* set = cpu_tc_set(tc, page_addr);
+    memmove(set + 1, set, (tc_ways - 1) * sizeof(TLBCache));
+    set->va = page_addr | (addr_in_ram(pa) ? 0 : TC_FLAG_MMIO);
+    set->tag = tag;
+    set->pa = pa;
+    set->addend = (uintptr_t)ram + pa - page_addr;
+}
+
+static void tc_fill_small(TLBCache* tc, int access_type, uint64_t addr, uint64_t tag, hwaddr pa) {
+    cpu_tc_fill(tc, addr & TARGET_PAGE_MASK, tag, pa & TARGET_PAGE_MASK);
+    if (access_type == MMU_DATA_STORE && !ram_page_dirty(pa)) {
+        cpu_tc_set(tc, addr & TARGET_PAGE_MASK)->va |= TC_FLAG_NOTDIRTY;
+    }
+}
+
+// fill tc_huge for a large page that is all ram, otherwise the TARGET_PAGE_SIZE tc
+void cpu_tc_fill_page(CPULoongArchState *env, TLBCache* tc, int access_type, uint64_t addr, uint64_t tag, hwaddr pa) {
+    int ps = env->mmu_ps;
+    uint64_t mask = ~((1ul << ps) - 1);
+    if (ps >= TC_HUGE_MIN_BITS && addr_range_in_ram(pa & mask, (pa & mask) + (1ul << ps))) {
+        TLBCacheHuge* e = &env->tc_huge[access_type][env->tc_huge_next[access_type]++ % TC_HUGE_NUM];
+        e->va = addr & mask;
+        e->mask = mask;
+        e->tag = tag;
+        e->pa = pa & mask;
+    } else {
+        tc_fill_small(tc, access_type, addr, tag, pa);
+        ps = TARGET_PAGE_BITS;
+    }
+    env->tc_ps_fill[ps] ++;
+}
+
+// looked up after a tc miss, a hit saves the page table walk and fills the
+// TARGET_PAGE_SIZE tc so the next access to this page hits there
+TLBCacheHuge* cpu_tc_huge_find(CPULoongArchState *env, TLBCache* tc, int access_type, uint64_t addr, uint64_t tag) {
+    TLBCacheHuge* e = env->tc_huge[access_type];
+    for (int i = 0; i < TC_HUGE_NUM; i++, e++) {
+        if (e->va == (addr & e->mask) && e->tag == tag) {
+            env->tc_ps_hit[ctz64(e->mask)] ++;
+            tc_fill_small(tc, access_type, addr, tag, (addr & ~e->mask) | e->pa);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static inline void tc_drop(TLBCache* e) {
+    e->va = -1;
+    e->tag = -1;
+}
+
+// drop the entries of [start, start + size), compared like the tlb does on
+// the low TARGET_VIRT_ADDR_SPACE_BITS of va
+void cpu_tc_flush_range(CPULoongArchState *env, uint64_t start, uint64_t size) {
+    TLBCache* tcs[] = {env->tc_load, env->tc_store, env->tc_fetch};
+    uint64_t sets = tc_set_mask + 1;
+    start &= TARGET_VIRT_MASK;
+    for (int t = 0; t < 3; t++) {
+        if ((size >> TARGET_PAGE_BITS) < sets) {
+            // a few pages, only look at their sets
+            for (uint64_t page = start; page < start + size; page += TARGET_PAGE_SIZE) {
+                TLBCache* set = cpu_tc_set(tcs[t], page);
+                for (int i = 0; i < tc_ways; i++) {
+                    if (((set[i].va & TARGET_VIRT_MASK & TARGET_PAGE_MASK) - start) < size) {
+                        tc_drop(&set[i]);
+                    }
+                }
+            }
+        } else {
+            for (uint64_t i = 0; i < sets * tc_ways; i++) {
+                if (((tcs[t][i].va & TARGET_VIRT_MASK & TARGET_PAGE_MASK) - start) < size) {
+                    tc_drop(&tcs[t][i]);
+                }
+            }
+        }
+        for (int i = 0; i < TC_HUGE_NUM; i++) {
+            TLBCacheHuge* e = &env->tc_huge[t][i];
+            uint64_t va = e->va & TARGET_VIRT_MASK;
+            if (va - start < size || start - va < ~e->mask + 1) {
+                e->va = -1;
+                e->tag = -1;
+            }
+        }
+    }
+    env->tc_flush_avoided ++;
+}
+
+void cpu_tc_flush_asid(CPULoongArchState *env, uint16_t asid) {
+    TLBCache* tcs[] = {env->tc_load, env->tc_store, env->tc_fetch};
+    uint64_t n = (tc_set_mask + 1) * tc_ways;
+    for (int t = 0; t < 3; t++) {
+        for (uint64_t i = 0; i < n; i++) {
+            if (((tcs[t][i].tag >> TC_ASID_SHIFT) & R_CSR_ASID_ASID_MASK) == asid) {
+                tc_drop(&tcs[t][i]);
+            }
+        }
+        for (int i = 0; i < TC_HUGE_NUM; i++) {
+            TLBCacheHuge* e = &env->tc_huge[t][i];
+            if (((e->tag >> TC_ASID_SHIFT) & R_CSR_ASID_ASID_MASK) == asid) {
+                e->va = -1;
+                e->tag = -1;
+            }
+        }
+    }
+    env->tc_flush_avoided ++;
+}
+
+#ifndef CONFIG_DIFF
+// --tlbc entries[,ways], e.g. 4096,4way
+static void handle_tlbc(const char* arg) {
+    char* end;
+    uint64_t entries = strtoul(arg, &end, 0);
+    uint64_t ways = 1;
+    if (*end == ',') {
+        ways = strtoul(end + 1, &end, 0);
+        if (strcmp(end, "way") == 0 || strcmp(end, "ways") == 0) {
+            end += strlen(end);
+        }
+    }
+    if (*end || !is_power_of_2(entries) || !is_power_of_2(ways) || ways > entries) {
+        fprintf(stderr, "invalid --tlbc %s, expect entries[,ways] as powers of 2, e.g. 4096,4way\n", arg);
+        laemu_exit(EXIT_FAILURE);
+    }
+    tc_ways = ways;
+    tc_set_mask = entries / ways - 1;
+}
+#endif
+#endif
+
+static uint32_t fetch(CPULoongArchState *env, INSCache** ic) {
+    uint32_t insn = ram_lduw(fetch_pa(env));
     *ic = cpu_get_ic(env, insn);
     return insn;
+}
+
+// debug cli, difftest and gdbserver need to stop at every instruction
+#if !defined (CONFIG_CLI) && !defined (CONFIG_DIFF) && !defined (CONFIG_GDB)
+#define USE_TBCACHE
+#define TB_GEN_INSNS TB_MAX_INSNS
+#endif
+
+// DIFF=1 JIT=1 runs every difftest step as a one instruction jit block, so
+// the ref checks jit code against the dut
+#if defined (CONFIG_DIFF) && defined (CONFIG_JIT) && !defined (CONFIG_CLI) && !defined (CONFIG_GDB)
+#define USE_TBCACHE
+#define TB_GEN_INSNS 1
+#endif
+
+// jit code does not call plugin hooks nor count perf events per instruction
+#if defined (USE_TBCACHE) && defined (CONFIG_JIT) && !defined (CONFIG_PLUGIN) && !defined (CONFIG_PERF)
+#define USE_JIT
+#endif
+
+// threaded dispatch does not call plugin hooks between instructions
+#if defined (USE_TBCACHE) && defined (CONFIG_THREADED) && !defined (CONFIG_PLUGIN) && !defined (CONFIG_DIFF)
+#define USE_THREADED
+#endif
+
+#if defined (USE_TBCACHE)
+// instructions after which the next pc or the translation context may change
+static inline bool tb_end_insn(uint32_t insn) {
+    uint32_t op = insn >> 26;
+    return (op >= 0x10 && op <= 0x1b)               /* beqz ... bgeu, jirl, b, bl */
+        || (insn >> 24) == 0x04                     /* csrrd, csrwr, csrxchg */
+        || (insn >> 24) == 0x06                     /* cacop, lddir, ldpte, iocsr, tlb, ertn, idle, invtlb */
+        || (insn & 0xfffe0000) == 0x002a0000        /* break, dbcl, syscall */
+        || (insn & 0xffff8000) == 0x38728000;       /* ibar */
+}
+
+static void tb_gen(CPULoongArchState *env, TBCache* tb, uint64_t pc, hwaddr pa) {
+    int i;
+    tb->pc = pc;
+    tb->pa = pa;
+    for (i = 0; i < TB_GEN_INSNS; i++) {
+        uint32_t insn = ram_lduw(pa + i * 4);
+        if (!interpreter_decode(env, insn, &tb->insns[i])) {
+            break;
+        }
+        if (tb_end_insn(insn) || ((pc + (i + 1) * 4) & ~TARGET_PAGE_MASK) == 0) {
+            i ++;
+            break;
+        }
+    }
+    tb->n = i;
+#if defined (USE_JIT)
+    tb->exec_count = 0;
+    tb->jit_code = NULL;
+#endif
+}
+
+/*
+ * Run the pre-decoded block at env->pc. Translation of pc is done once per
+ * block, each record still compares its insn against guest memory like
+ * cpu_get_ic, so modified code is picked up without extra invalidation.
+ * Return false if the caller should execute one instruction by itself.
+ */
+static bool tb_exec(CPULoongArchState *env) {
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_EXEC | CPU_LOG_TB_CPU))) {
+        return false;
+    }
+    uint64_t pc = env->pc;
+    hwaddr pa = fetch_pa(env);
+    TBCache* tb = &env->tbcache[TB_INDEX(pc)];
+    if (likely(tb->pc == pc && tb->pa == pa && tb->n && ram_lduw(pa) == tb->insns[0].insn)) {
+        ++ env->tb_hit_count;
+    } else {
+        ++ env->tb_miss_count;
+        tb_gen(env, tb, pc, pa);
+        if (!tb->n) {
+            return false;
+        }
+    }
+    int n = tb->n;
+#if !defined (CONFIG_USER_ONLY)
+    // stop where loongarch_cpu_check_irq would fire the timer, keep -z exact
+    if (env->timer_deadline - env->icount < n) {
+        n = env->timer_deadline - env->icount;
+    }
+#endif
+#if defined (USE_JIT)
+    if (!tb->jit_code && ++ tb->exec_count >= JIT_HOT_COUNT) {
+        // count again if jit is off, instead of overflowing
+        tb->exec_count = 0;
+        tb->jit_code = jit_compile(env, tb);
+    }
+    if (tb->jit_code && n == tb->n) {
+#if defined (CONFIG_DIFF)
+        env->insn = tb->insns[0].insn;
+        env->prev_pc = pc;
 #endif
+        int done = ((JitFunc)tb->jit_code)(env);
+        if (unlikely(done < n)) {
+            tb->n = 0;
+        }
+#if defined (CONFIG_DIFF)
+        singlestep -= done;
+#endif
+        return done != 0;
+    }
+#endif
+#if defined (CONFIG_DIFF)
+    // not compiled, exec_env steps it
+    return false;
+#endif
+#if defined (USE_THREADED)
+    if (unlikely(interpreter_exec_tb(env, tb->insns, n, pa) < n)) {
+        tb->n = 0;
+    }
+#else
+    for (int i = 0; i < n; i++, pa += 4) {
+        INSCache* ic = &tb->insns[i];
+        if (i > 0 && unlikely(ram_lduw(pa) != ic->insn)) {
+            tb->n = 0;
+            break;
+        }
+#if defined(CONFIG_PLUGIN)
+        if (plugin_ops && plugin_ops->emu_insn_before) {
+            plugin_ops->emu_insn_before(env, env->pc, ic->insn);
+        }
+#endif
+        ic->trans_func(env, ic->arg);
+        env->gpr[0] = 0;
+        env->icount ++;
+        PERF_INC(COUNTER_INST);
+    }
+#endif
+    return true;
 }
+#endif
 
 int val;
 
+#if !defined (CONFIG_USER_ONLY)
+/*
+ * Interrupts are only looked at when something may have raised or unmasked
+ * one (irq_pending), or when icount reaches the -z timer deadline. Blocks
+ * stop at the deadline, so the timer still fires at the exact icount.
+ * difftest and the debug cli change CSRs behind our back, so poll always.
+ */
+static inline bool cpu_irq_work(CPULoongArchState *env) {
+#if defined (CONFIG_DIFF) || defined (CONFIG_CLI)
+    return true;
+#else
+    return env->irq_pending || env->icount >= env->timer_deadline;
+#endif
+}
+#endif
+
 int exec_env(CPULoongArchState *env) {
     INSCache* ic;
     current_env = env;
     CPUState* cs = env_cpu(env);
+#if !defined (CONFIG_USER_ONLY)
+    // state may have been restored or changed by gdb since the last call
+    env->irq_pending = true;
+#endif
+#if defined (USE_TBCACHE)
+    if (!env->tbcache) {
+        env->tbcache = calloc(TB_NUM, sizeof(TBCache));
+        lsassert(env->tbcache);
+    }
+#endif
     while (1) {
         if (sigsetjmp(env_cpu(env)->jmp_env, 0) == 0) {
             uint32_t insn;
@@ -769,12 +1302,15 @@ int exec_env(CPULoongArchState *env) {
 #endif
 
 #if !defined (CONFIG_USER_ONLY)
+                if (unlikely(cpu_irq_work(env))) {
+                    env->irq_pending = false;
 #if !defined (CONFIG_DIFF)
-                loongarch_cpu_check_irq(env);
+                    loongarch_cpu_check_irq(env);
 #endif
-                if (unlikely(loongarch_cpu_has_irq(env))) {
-                    cs->exception_index = EXCCODE_INT;
-                    loongarch_cpu_do_interrupt(cs);
+                    if (unlikely(loongarch_cpu_has_irq(env))) {
+                        cs->exception_index = EXCCODE_INT;
+                        loongarch_cpu_do_interrupt(cs);
+                    }
                 }
 #endif
 
@@ -790,6 +1326,12 @@ int exec_env(CPULoongArchState *env) {
                 }
 #endif
 
+#if defined (USE_TBCACHE)
+                if (likely(tb_exec(env))) {
+                    continue;
+                }
+#endif
+
                 if (unlikely(qemu_loglevel_mask(CPU_LOG_EXEC))) {
                     qemu_log("pc:%lx\n", env->pc);
                 }
@@ -825,6 +1367,9 @@ int exec_env(CPULoongArchState *env) {
         } else {
             loongarch_cpu_do_interrupt(cs);
             env->ecount ++;
+#if !defined (CONFIG_USER_ONLY) && !defined (CONFIG_DIFF)
+            cpu_timer_exception_tick(env);
+#endif
         }
     }
 }
@@ -843,7 +1388,6 @@ void G_NORETURN do_raise_exception(CPULoongArchState *env,
                                    uintptr_t pc)
 {
     CPUState *cs = env_cpu(env);
-    cpu_clear_tc(env);
 
     qemu_log_mask(CPU_LOG_INT, "%s: %d (%s)\n",
                   __func__,
@@ -987,70 +1531,152 @@ void handle_checkmask(const char* str) {
 }
 
 #if !defined(CONFIG_USER_ONLY)
-void do_io_st(hwaddr ha, uint64_t data, int size) {
-    switch (ha)
-    {
-    case UART_BASE ... UART_END:
-        if (serial_plus) {
-            serial_plus_ioport_write(ss, ha - UART_BASE, data, size);
-        } else {
-            serial_ioport_write(NULL, ha - UART_BASE, data, size);
-        }
-        break;
-    case 0x1fe002e0:
-            fprintf(stderr, "%c", (char)(data));
-            fflush(stdout);
-        break;
+#ifndef CONFIG_DIFF
+static uint64_t uart_read(void *opaque, uint64_t addr, unsigned size) {
+    if (serial_plus) {
+        return serial_plus_ioport_read(ss, addr, size);
+    }
+    return serial_ioport_read(NULL, addr, size);
+}
+
+static void uart_write(void *opaque, uint64_t addr, uint64_t val, unsigned size) {
+    if (serial_plus) {
+        serial_plus_ioport_write(ss, addr, val, size);
+    } else {
+        serial_ioport_write(NULL, addr, val, size);
+    }
+}
 
-    case 0x100d0014:
-        fprintf(stderr,"lxy: %s:%d %s poweroff@100d0014 data:%x\n",__FILE__, __LINE__, __FUNCTION__, (int)data);
-        if ((data & 0x3c00) == 0x3c00) {
-            dump_exec_info(current_env, stderr);
+static void console_write(void *opaque, uint64_t addr, uint64_t val, unsigned size) {
+    fprintf(stderr, "%c", (char)(val));
+    fflush(stdout);
+}
+
+static uint64_t chip_read(void *opaque, uint64_t addr, unsigned size) {
+    return 'a';
+}
+
+static void poweroff_write(void *opaque, uint64_t addr, uint64_t val, unsigned size) {
+    fprintf(stderr,"lxy: %s:%d %s poweroff@100d0014 data:%x\n",__FILE__, __LINE__, __FUNCTION__, (int)val);
+    if ((val & 0x3c00) == 0x3c00) {
+        dump_exec_info(current_env, stderr);
 #if defined(CONFIG_PERF)
-            perf_report(current_env, stderr);
+        perf_report(current_env, stderr);
 #endif
-            laemu_exit(0);
-        }
-        break;
-    default:
-        fprintf(stderr, "do_io_st, pc:%lx, addr:%lx, data:%lx, size:%d\n", current_env->pc, ha, data, size);
-        // lsassert(0);
+        laemu_exit(0);
     }
 }
-uint64_t do_io_ld(hwaddr ha, int size) {
-    uint64_t data = 'x';
-    switch (ha)
-    {
-    case UART_BASE ... UART_END:
-        if (serial_plus) {
-            data = serial_plus_ioport_read(ss, ha - UART_BASE, size);
+
+// instance number, 0 before cloning, 1..n in the clones
+static uint64_t clone_id;
+// --clone n, clone right before execution starts
+static int clone_num;
+// how ram_fd is mapped in this instance
+static int ram_map_flags = MAP_SHARED;
+
+bool ram_is_shared(void) {
+    return ram_fd >= 0 && (ram_map_flags & MAP_SHARED);
+}
+
+static void recreate_timer(timer_t* id, int signo, const struct itimerspec* its) {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = signo;
+    sev.sigev_value.sival_ptr = id;
+    lsassert(timer_create(CLOCK_MONOTONIC, &sev, id) == 0);
+    lsassert(timer_settime(*id, 0, its, NULL) == 0);
+}
+
+/*
+ * Fork n instances of the current guest. Untouched ram pages stay shared
+ * copy-on-write: anonymous ram by fork itself, ram_fd backed ram by mapping
+ * the file privately in every clone. The original instance only waits for
+ * the clones and exits.
+ */
+static void clone_instances(CPULoongArchState *env, int n) {
+    struct itimerspec its, serial_its;
+    // posix timers are not inherited by fork, rearm them in the clones
+    lsassert(timer_gettime(env->timerid, &its) == 0);
+    if (serial_plus) {
+        lsassert(timer_gettime(serial_timerid, &serial_its) == 0);
+    }
+    // the clones would not inherit the userfaultfd of a lazy restore
+    ckpt_lazy_finish();
+    fprintf(stderr, "clone %d instances at icount:%ld\n", n, env->icount);
+    fflush(stdout);
+    fflush(stderr);
+    fflush(logfile);
+    pid_t* pids = malloc(n * sizeof(pid_t));
+    for (int i = 0; i < n; i++) {
+        pids[i] = fork();
+        lsassertm(pids[i] >= 0, "fork failed, error:%s\n", strerror(errno));
+        if (pids[i] == 0) {
+            free(pids);
+            clone_id = i + 1;
+            ckpt_writers_forget();
+            if (ram_fd >= 0 && ram_map_flags == MAP_SHARED) {
+                // a private hugetlb mapping would reserve all of ram again in
+                // every clone, only the pages actually copied are taken
+                ram_map_flags = MAP_PRIVATE;
+                if (hugepage_mode == HUGEPAGE_HUGETLB) {
+                    ram_map_flags |= MAP_NORESERVE;
+                }
+                map_ram(ram, ram_map_flags);
+            }
+            recreate_timer(&env->timerid, SIGRTMIN, &its);
+            if (serial_plus) {
+                recreate_timer(&serial_timerid, SIGRTMIN + 1, &serial_its);
+            }
+            return;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        int status;
+        lsassert(waitpid(pids[i], &status, 0) == pids[i]);
+        if (WIFEXITED(status)) {
+            fprintf(stderr, "clone %d pid:%d exit:%d\n", i + 1, pids[i], WEXITSTATUS(status));
+            failed += WEXITSTATUS(status) != 0;
         } else {
-            data = serial_ioport_read(NULL, ha - UART_BASE, size);
+            fprintf(stderr, "clone %d pid:%d signal:%d\n", i + 1, pids[i], WTERMSIG(status));
+            failed ++;
         }
-        break;
-    case 0x1fe00120:
-            data = 'a';
-        break;
-    case 0x100d0014:
-        data = 0;
-        break;
-    default:
-        fprintf(stderr, "do_io_ld, addr:%lx, size:%d\n", ha, size);
-        break;
     }
-    return data;
+    laemu_exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
+// guest reads its instance number, writing n clones the guest n times
+static uint64_t clone_read(void *opaque, uint64_t addr, unsigned size) {
+    return clone_id;
+}
+
+static void clone_write(void *opaque, uint64_t addr, uint64_t val, unsigned size) {
+    if (val) {
+        lsassertm(val <= CLONE_MAX, "too many clones %ld\n", val);
+        clone_instances(current_env, val);
+    }
+}
+
+// everything outside ram goes to these, anything else is reported as unassigned
+static void register_devices(void) {
+    mmio_register("uart", UART_BASE, UART_END - UART_BASE + 1, uart_read, uart_write, NULL, 0);
+    mmio_register("console", 0x1fe002e0, 1, NULL, console_write, NULL, 0);
+    mmio_register("chip", 0x1fe00120, 1, chip_read, NULL, NULL, 0);
+    mmio_register("poweroff", 0x100d0014, 4, NULL, poweroff_write, NULL, 0);
+    mmio_register("clone", CLONE_BASE, 8, clone_read, clone_write, NULL, 0);
+}
+#endif
+
 void loongarch_cpu_check_irq(CPULoongArchState *env) {
     if (determined) {
-        env->timer_counter -= (env->CSR_TCFG & CONSTANT_TIMER_ENABLE);
-        if (env->timer_counter == 0) {
-            env->timer_counter = INT64_MAX;
+        if (env->icount >= env->timer_deadline) {
             loongarch_cpu_set_irq(env, IRQ_TIMER, 1);
             if (FIELD_EX64(env->CSR_TCFG, CSR_TCFG, PERIODIC)) {
-                env->timer_counter = (env->CSR_TCFG & CONSTANT_TIMER_TICK_MASK) / TIME_SCALE;
+                cpu_set_timer_counter(env, (env->CSR_TCFG & CONSTANT_TIMER_TICK_MASK) / TIME_SCALE, env->icount);
             } else {
                 env->CSR_TCFG = FIELD_DP64(env->CSR_TCFG, CSR_TCFG, EN, 0);
+                cpu_set_timer_counter(env, INT64_MAX, env->icount);
             }
         }
     } else {
@@ -1085,9 +1711,86 @@ struct option long_options[] = {
     {"kernel", required_argument, 0, 'k'},
     {"initrd", required_argument, 0, 0},
     {"append", required_argument, 0, 0},
+    {"tlbc", required_argument, 0, 0},
+    {"hugepage", required_argument, 0, 0},
+    {"memfd", no_argument, 0, 0},
+    {"clone", required_argument, 0, 0},
+    {"ckpt-delta", no_argument, 0, 0},
+    {"ckpt-lz", no_argument, 0, 0},
+    {"ckpt-store", required_argument, 0, 0},
+    {"ckpt-lazy", no_argument, 0, 0},
+    {"ckpt-compact", required_argument, 0, 0},
     {0, 0 ,0 ,0}
 };
 
+#if defined(CONFIG_USER_ONLY)
+// the initial stack of a program: its arguments, environment and auxv
+static void user_init_stack(CPULoongArchState* env, int guest_argc, char** guest_argv, char** envp) {
+    target_ulong sp = user_setup_stack();
+    size_t* guest_argv_len = (size_t*)malloc(sizeof(size_t) * guest_argc);
+    target_ulong* guest_argv_addr = (target_ulong*)malloc(sizeof(target_ulong) * guest_argc);
+    for (int i = 0; i < guest_argc; i++) {
+        guest_argv_len[i] = strlen(guest_argv[i]);
+        sp -= (guest_argv_len[i] + 1);
+        memcpy((void*)(sp), guest_argv[i], guest_argv_len[i]);
+        guest_argv_addr[i] = sp;
+        // fprintf(stderr, "setup argv %s %lx %ld\n", guest_argv[i], sp, guest_argv_len[i]);
+    }
+
+    int guest_envc = 0;
+    while (envp[guest_envc]) {guest_envc ++;}
+    // fprintf(stderr, "guest_envc %d\n", guest_envc);
+    char** guest_envv = envp;
+    size_t* guest_envv_len = (size_t*)malloc(sizeof(size_t) * guest_envc);
+    target_ulong* guest_envv_addr = (target_ulong*)malloc(sizeof(target_ulong) * guest_envc);
+    for (int i = 0; i < guest_envc; i++) {
+        guest_envv_len[i] = strlen(guest_envv[i]);
+        sp -= (guest_envv_len[i] + 1);
+        memcpy((void*)(sp), guest_envv[i], guest_envv_len[i]);
+        guest_envv_addr[i] = sp;
+        // fprintf(stderr, "setup envv %s %lx %ld\n", guest_envv[i], sp, guest_envv_addr[i]);
+    }
+    sp = QEMU_ALIGN_DOWN(sp, 16);
+
+    sp -= 16;
+    abi_ulong u_rand_bytes = sp;
+    ram_std(sp+0, 0x0011223344556677);
+    ram_std(sp+8, 0x8899aabbccddeeff);
+
+    if ((guest_argc + guest_envc) % 2 == 0) {
+        sp -=8;
+    }
+
+    sp -= 16; ram_std(sp, AT_RANDOM);ram_std(sp+8, u_rand_bytes);
+    sp -= 16; ram_std(sp, AT_PHDR);  ram_std(sp+8, (abi_ulong)(info.load_addr + e_phoff));
+    sp -= 16; ram_std(sp, AT_PHENT); ram_std(sp+8, (abi_ulong)(sizeof (elf_phdr)));
+    sp -= 16; ram_std(sp, AT_PHNUM); ram_std(sp+8, (abi_ulong)(e_phnum));
+    sp -= 16; ram_std(sp, AT_PAGESZ);ram_std(sp+8, TARGET_PAGE_SIZE);
+    sp -= 16; ram_std(sp, AT_UID);   ram_std(sp+8, (abi_ulong) getuid());
+    sp -= 16; ram_std(sp, AT_EUID);  ram_std(sp+8, (abi_ulong) geteuid());
+    sp -= 16; ram_std(sp, AT_GID);   ram_std(sp+8, (abi_ulong) getgid());
+    sp -= 16; ram_std(sp, AT_EGID);  ram_std(sp+8, (abi_ulong) getegid());
+
+    qemu_log_mask(CPU_LOG_PAGE, "aux addr %lx\n", sp);
+
+    target_ulong guest_arg_size = ( 1 + guest_argc + 1 + guest_envc + 1) * 8;
+    sp -= guest_arg_size;
+    ram_std(sp, guest_argc);
+    for (int i = 0; i < guest_argc; i++) {
+        ram_std(sp + 8 + (i * 8), guest_argv_addr[i]);
+    }
+    for (int i = 0; i < guest_envc; i++) {
+        ram_std(sp + (1 + guest_argc + 1) * 8 +(i * 8), guest_envv_addr[i]);
+    }
+    env->gpr[3] = sp;
+    // fprintf(stderr, "guest_sp:%lx\n", sp);
+    // for (int i = 0; i < guest_argc + 2; i++) {
+    //     fprintf(stderr, "%lx %lx\n", sp, ram_ldud(sp + i *8));
+    // }
+    qemu_log_mask(CPU_LOG_PAGE, "init sp %lx\n", sp);
+}
+#endif
+
 int main(int argc, char** argv, char **envp) {
     logfile = stderr;
     if (argc < 2) {
@@ -1149,6 +1852,10 @@ int main(int argc, char** argv, char **envp) {
             }
                 break;
             case 0: // deal long options
+                if (strcmp(long_options[long_option_idx].name, "hugepage") == 0) {
+                    handle_hugepage(optarg);
+                    break;
+                }
 #if !defined (CONFIG_USER_ONLY)
                 if (strcmp(long_options[long_option_idx].name, "ckpt-mem") == 0) {
                     ckpt_mem_filename = optarg;
@@ -1161,6 +1868,26 @@ int main(int argc, char** argv, char **envp) {
                 } else if (strcmp(long_options[long_option_idx].name, "append") == 0) {
                     kernel_cmdline = optarg;
                     strcpy(real_kernel_cmdline, kernel_cmdline);
+                } else if (strcmp(long_options[long_option_idx].name, "tlbc") == 0) {
+                    handle_tlbc(optarg);
+                } else if (strcmp(long_options[long_option_idx].name, "ckpt-delta") == 0) {
+                    ckpt_delta = true;
+                } else if (strcmp(long_options[long_option_idx].name, "ckpt-lz") == 0) {
+                    ckpt_lz = true;
+                } else if (strcmp(long_options[long_option_idx].name, "ckpt-store") == 0) {
+                    ckpt_store = optarg;
+                } else if (strcmp(long_options[long_option_idx].name, "ckpt-lazy") == 0) {
+                    ckpt_lazy = true;
+                } else if (strcmp(long_options[long_option_idx].name, "ckpt-compact") == 0) {
+                    ckpt_compact_dir = optarg;
+                } else if (strcmp(long_options[long_option_idx].name, "memfd") == 0) {
+                    ram_memfd = true;
+                } else if (strcmp(long_options[long_option_idx].name, "clone") == 0) {
+                    clone_num = atoi(optarg);
+                    if (clone_num <= 0 || clone_num > CLONE_MAX) {
+                        fprintf(stderr, "--clone should be 1-%d\n", CLONE_MAX);
+                        return 1;
+                    }
                 } else {
                     usage();
                     return 1;
@@ -1185,7 +1912,7 @@ int main(int argc, char** argv, char **envp) {
         fprintf(stderr, "cannot specify -k and --ckpt-mem/--ckpt-cpu at same time\n");
         return 1;
     }
-    if (!kernel_filename) {
+    if (!kernel_filename && !ckpt_compact_dir) {
         if (!ckpt_mem_filename && !ckpt_cpu_filename) {
             fprintf(stderr, "need specify -k or --ckpt-mem/--ckpt-cpu\n");
             return 1;
@@ -1197,8 +1924,16 @@ int main(int argc, char** argv, char **envp) {
     }
 
 #ifndef CONFIG_USER_ONLY
+    if (ckpt_lazy && (ram_memfd || hugepage_mode == HUGEPAGE_HUGETLB)) {
+        fprintf(stderr, "--ckpt-lazy needs anonymous ram, not --memfd or hugetlb pages\n");
+        return 1;
+    }
     ram = alloc_ram(ram_size);
     qemu_log("pid:%d, ram_size:%lx kernel_filename:%s\n", getpid(), ram_size, kernel_filename);
+    if (ckpt_compact_dir) {
+        compact_checkpoint(ckpt_compact_dir);
+        return 0;
+    }
 #endif
     uint64_t entry_addr;
 #if defined(CONFIG_USER_ONLY)
@@ -1208,16 +1943,23 @@ int main(int argc, char** argv, char **envp) {
 
     qemu_log_mask(CPU_LOG_PAGE, "TARGET_PAGE_SIZE:%lx TARGET_PAGE_BITS:%ld TARGET_PAGE_MASK:%lx\n", TARGET_PAGE_SIZE, TARGET_PAGE_BITS, TARGET_PAGE_MASK);
 
-    kernel_filename = argv[optind];
-    if(!kernel_filename) {
+    // without a program, -k names a checkpoint to resume
+    if (argv[optind]) {
+        kernel_filename = argv[optind];
+    } else if (!kernel_filename || !is_directory(kernel_filename)) {
         usage();
         laemu_exit(EXIT_FAILURE);
     }
-    load_elf_user(kernel_filename, &entry_addr);
-    target_set_brk(info.brk);
-    exec_path = kernel_filename;
-    if (realpath(exec_path, real_exec_path)) {
-        exec_path = real_exec_path;
+    if (!is_directory(kernel_filename)) {
+        load_elf_user(kernel_filename, &entry_addr);
+        target_set_brk(info.brk);
+        exec_path = kernel_filename;
+        if (realpath(exec_path, real_exec_path)) {
+            exec_path = real_exec_path;
+        }
+    } else {
+        // before plugins and caches take host memory that the guest had
+        reserve_user_regions(kernel_filename);
     }
 #else
     if (kernel_filename && !is_directory(kernel_filename)) {
@@ -1278,8 +2020,10 @@ int main(int argc, char** argv, char **envp) {
         }
     }
     cpu_clear_tc(env);
-    env->timer_counter = INT64_MAX;
+    cpu_set_timer_counter(env, INT64_MAX, 0);
 #ifndef CONFIG_USER_ONLY
+    cpu_tc_init(env);
+    register_devices();
     env->timerid = timerid;
     if (serial_plus) {
         qemu_irq irq = qemu_allocate_irq(loongarch_cpu_set_irq, (void*)env, 7);
@@ -1347,6 +2091,7 @@ int main(int argc, char** argv, char **envp) {
             for (int i = 0; i < count; i++) {
                 printf("%s\n", words[i]);
                 ram_std(argv_addr, arg_str_addr + (words[i] - real_kernel_cmdline));
+                ram_set_dirty(argv_addr);
                 printf("argv %lx %lx\n", argv_addr, arg_str_addr + (words[i] - real_kernel_cmdline));
                 argv_addr += 8;
             }
@@ -1379,70 +2124,18 @@ int main(int argc, char** argv, char **envp) {
 #endif
 
 #if defined(CONFIG_USER_ONLY)
-    target_ulong sp = user_setup_stack();
-    int guest_argc = argc - optind;
-    char** guest_argv = argv + optind;
-    size_t* guest_argv_len = (size_t*)malloc(sizeof(size_t) * guest_argc);
-    target_ulong* guest_argv_addr = (target_ulong*)malloc(sizeof(target_ulong) * guest_argc);
-    for (int i = 0; i < guest_argc; i++) {
-        guest_argv_len[i] = strlen(guest_argv[i]);
-        sp -= (guest_argv_len[i] + 1);
-        memcpy((void*)(sp), guest_argv[i], guest_argv_len[i]);
-        guest_argv_addr[i] = sp;
-        // fprintf(stderr, "setup argv %s %lx %ld\n", guest_argv[i], sp, guest_argv_len[i]);
-    }
-
-    int guest_envc = 0;
-    while (envp[guest_envc]) {guest_envc ++;}
-    // fprintf(stderr, "guest_envc %d\n", guest_envc);
-    char** guest_envv = envp;
-    size_t* guest_envv_len = (size_t*)malloc(sizeof(size_t) * guest_envc);
-    target_ulong* guest_envv_addr = (target_ulong*)malloc(sizeof(target_ulong) * guest_envc);
-    for (int i = 0; i < guest_envc; i++) {
-        guest_envv_len[i] = strlen(guest_envv[i]);
-        sp -= (guest_envv_len[i] + 1);
-        memcpy((void*)(sp), guest_envv[i], guest_envv_len[i]);
-        guest_envv_addr[i] = sp;
-        // fprintf(stderr, "setup envv %s %lx %ld\n", guest_envv[i], sp, guest_envv_addr[i]);
+    if (!is_directory(kernel_filename)) {
+        user_init_stack(env, argc - optind, argv + optind, envp);
     }
-    sp = QEMU_ALIGN_DOWN(sp, 16);
-
-    sp -= 16;
-    abi_ulong u_rand_bytes = sp;
-    ram_std(sp+0, 0x0011223344556677);
-    ram_std(sp+8, 0x8899aabbccddeeff);
-
-    if ((guest_argc + guest_envc) % 2 == 0) {
-        sp -=8;
-    }
-
-    sp -= 16; ram_std(sp, AT_RANDOM);ram_std(sp+8, u_rand_bytes);
-    sp -= 16; ram_std(sp, AT_PHDR);  ram_std(sp+8, (abi_ulong)(info.load_addr + e_phoff));
-    sp -= 16; ram_std(sp, AT_PHENT); ram_std(sp+8, (abi_ulong)(sizeof (elf_phdr)));
-    sp -= 16; ram_std(sp, AT_PHNUM); ram_std(sp+8, (abi_ulong)(e_phnum));
-    sp -= 16; ram_std(sp, AT_PAGESZ);ram_std(sp+8, TARGET_PAGE_SIZE);
-    sp -= 16; ram_std(sp, AT_UID);   ram_std(sp+8, (abi_ulong) getuid());
-    sp -= 16; ram_std(sp, AT_EUID);  ram_std(sp+8, (abi_ulong) geteuid());
-    sp -= 16; ram_std(sp, AT_GID);   ram_std(sp+8, (abi_ulong) getgid());
-    sp -= 16; ram_std(sp, AT_EGID);  ram_std(sp+8, (abi_ulong) getegid());
-
-    qemu_log_mask(CPU_LOG_PAGE, "aux addr %lx\n", sp);
-
-    target_ulong guest_arg_size = ( 1 + guest_argc + 1 + guest_envc + 1) * 8;
-    sp -= guest_arg_size;
-    ram_std(sp, guest_argc);
-    for (int i = 0; i < guest_argc; i++) {
-        ram_std(sp + 8 + (i * 8), guest_argv_addr[i]);
+#endif
+    if (hugepage_mode != HUGEPAGE_NONE) {
+        hugepage_report("startup");
+        atexit(hugepage_report_exit);
     }
-    for (int i = 0; i < guest_envc; i++) {
-        ram_std(sp + (1 + guest_argc + 1) * 8 +(i * 8), guest_envv_addr[i]);
+#ifndef CONFIG_USER_ONLY
+    if (clone_num) {
+        clone_instances(env, clone_num);
     }
-    env->gpr[3] = sp;
-    // fprintf(stderr, "guest_sp:%lx\n", sp);
-    // for (int i = 0; i < guest_argc + 2; i++) {
-    //     fprintf(stderr, "%lx %lx\n", sp, ram_ldud(sp + i *8));
-    // }
-    qemu_log_mask(CPU_LOG_PAGE, "init sp %lx\n", sp);
 #endif
     current_env = env;
 #if defined(CONFIG_PLUGIN)
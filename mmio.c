@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "mmio.h"
+
+// sorted by base, never overlapping
+static MMIORegion regions[MMIO_MAX_REGIONS];
+static int nr_regions;
+// most device accesses go to the device of the previous one
+static MMIORegion *last_region;
+static uint64_t unassigned_read_count;
+static uint64_t unassigned_write_count;
+
+MMIORegion* mmio_register(const char *name, uint64_t base, uint64_t size,
+                          MMIOReadFunc read, MMIOWriteFunc write, void *opaque,
+                          unsigned max_access) {
+    int i;
+    lsassertm(nr_regions < MMIO_MAX_REGIONS, "too many mmio regions, %s\n", name);
+    lsassertm(size && base + size > base, "bad mmio region %s\n", name);
+    for (i = 0; i < nr_regions && regions[i].base < base; i++) {
+    }
+    lsassertm(i == 0 || regions[i - 1].base + regions[i - 1].size <= base,
+              "mmio region %s overlaps %s\n", name, regions[i - 1].name);
+    lsassertm(i == nr_regions || base + size <= regions[i].base,
+              "mmio region %s overlaps %s\n", name, regions[i].name);
+    memmove(&regions[i + 1], &regions[i], (nr_regions - i) * sizeof(MMIORegion));
+    nr_regions ++;
+    last_region = NULL;
+    regions[i] = (MMIORegion) {
+        .name = name, .base = base, .size = size,
+        .read = read, .write = write, .opaque = opaque,
+        .max_access = max_access,
+    };
+    return &regions[i];
+}
+
+MMIORegion* mmio_find(uint64_t pa) {
+    MMIORegion *r = last_region;
+    if (r && pa - r->base < r->size) {
+        return r;
+    }
+    int lo = 0, hi = nr_regions;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pa < regions[mid].base) {
+            hi = mid;
+        } else if (pa - regions[mid].base >= regions[mid].size) {
+            lo = mid + 1;
+        } else {
+            last_region = &regions[mid];
+            return last_region;
+        }
+    }
+    return NULL;
+}
+
+uint64_t mmio_read(uint64_t pa, unsigned size) {
+    MMIORegion *r = mmio_find(pa);
+    if (!r) {
+        unassigned_read_count ++;
+        fprintf(stderr, "do_io_ld, addr:%lx, size:%d\n", pa, size);
+        return 'x';
+    }
+    r->read_count ++;
+    if (!r->read) {
+        return 0;
+    }
+    uint64_t off = pa - r->base;
+    if (!r->max_access || size <= r->max_access) {
+        return r->read(r->opaque, off, size);
+    }
+    uint64_t data = 0;
+    for (unsigned i = 0; i < size; i += r->max_access) {
+        data |= r->read(r->opaque, off + i, r->max_access) << (i * 8);
+    }
+    return data;
+}
+
+void mmio_write(uint64_t pa, uint64_t val, unsigned size) {
+    MMIORegion *r = mmio_find(pa);
+    if (!r) {
+        unassigned_write_count ++;
+        fprintf(stderr, "do_io_st, pc:%lx, addr:%lx, data:%lx, size:%d\n", current_env->pc, pa, val, size);
+        return;
+    }
+    r->write_count ++;
+    if (!r->write) {
+        return;
+    }
+    uint64_t off = pa - r->base;
+    if (!r->max_access || size <= r->max_access) {
+        r->write(r->opaque, off, val, size);
+        return;
+    }
+    for (unsigned i = 0; i < size; i += r->max_access) {
+        r->write(r->opaque, off + i, val >> (i * 8), r->max_access);
+    }
+}
+
+void mmio_report(FILE *f) {
+    for (int i = 0; i < nr_regions; i++) {
+        MMIORegion *r = &regions[i];
+        if (r->read_count || r->write_count) {
+            fprintf(f, "mmio %s %lx-%lx: read:%ld write:%ld\n", r->name, r->base, r->base + r->size - 1, r->read_count, r->write_count);
+        }
+    }
+    if (unassigned_read_count || unassigned_write_count) {
+        fprintf(f, "mmio unassigned: read:%ld write:%ld\n", unassigned_read_count, unassigned_write_count);
+    }
+}
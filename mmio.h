@@ -0,0 +1,33 @@
+#ifndef __MMIO_H__
+#define __MMIO_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef uint64_t (*MMIOReadFunc)(void *opaque, uint64_t addr, unsigned size);
+typedef void (*MMIOWriteFunc)(void *opaque, uint64_t addr, uint64_t val, unsigned size);
+
+// a device window [base, base + size), callbacks get the offset into it
+typedef struct MMIORegion {
+    const char *name;
+    uint64_t base;
+    uint64_t size;
+    MMIOReadFunc read;      // NULL reads as 0
+    MMIOWriteFunc write;    // NULL ignores writes
+    void *opaque;
+    unsigned max_access;    // wider accesses are split little endian, 0 for any width
+    uint64_t read_count;
+    uint64_t write_count;
+} MMIORegion;
+
+#define MMIO_MAX_REGIONS 64
+
+MMIORegion* mmio_register(const char *name, uint64_t base, uint64_t size,
+                          MMIOReadFunc read, MMIOWriteFunc write, void *opaque,
+                          unsigned max_access);
+MMIORegion* mmio_find(uint64_t pa);
+uint64_t mmio_read(uint64_t pa, unsigned size);
+void mmio_write(uint64_t pa, uint64_t val, unsigned size);
+void mmio_report(FILE *f);
+
+#endif
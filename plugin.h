@@ -15,5 +15,9 @@ typedef struct la_emu_plugin_ops {
 typedef la_emu_plugin_ops* (*la_emu_plugin_install_func_t)(const char *);
 
 void la_emu_save_checkpoint(void *env, char* name);
+// write the checkpoint in a forked child, with at most max_writers at once
+void la_emu_save_checkpoint_async(void *env, char* name, int max_writers);
+// 0 if guest ram is shared with a file, a forked writer would see it change
+int la_emu_checkpoint_can_fork(void);
 
 #endif /* PLUGIN_H */
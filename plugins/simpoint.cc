@@ -19,11 +19,21 @@ map<uint64_t, uint64_t> icount2id;
 uint64_t icount;
 bool begin_collect;
 string ckpt_save_path;
+// writers=n, save checkpoints in up to n forked writers while emulation goes on
+int ckpt_writers;
 
 bool dump_first_interval;
 double first_interval_weight;
 uint64_t first_interval_id;
 
+static void save_checkpoint(void* env, string name) {
+    if (ckpt_writers) {
+        la_emu_save_checkpoint_async(env, (char*)name.c_str(), ckpt_writers);
+    } else {
+        la_emu_save_checkpoint(env, (char*)name.c_str());
+    }
+}
+
 static void check_exit() {
     if (icount2weight.empty() && !dump_first_interval) {
         fprintf(stderr, "all checkpoints have been dumped\n");
@@ -44,14 +54,14 @@ void my_emu_insn_before(void* env, uint64_t pc, uint32_t insn) {
 
     if (dump_first_interval && icount == 0) {
         fprintf(stderr, "simpoint dump first interval,weight=%lf,id=%ld\n", first_interval_weight, first_interval_id);
-        la_emu_save_checkpoint(env, (char*)(ckpt_save_path  + "/" + "w" + to_string(first_interval_weight) + "_" + to_string(first_interval_id)).c_str());
+        save_checkpoint(env, ckpt_save_path  + "/" + "w" + to_string(first_interval_weight) + "_" + to_string(first_interval_id));
         dump_first_interval = false;
         check_exit();
     }
 
     if (icount2weight.count(icount)) {
         fprintf(stderr, "simpoint dump checkpoint at icount=%ld,weight=%lf,id=%ld\n", icount, icount2weight[icount], icount2id[icount]);
-        la_emu_save_checkpoint(env, (char*)(ckpt_save_path  + "/" + "w" + to_string(icount2weight[icount]) + "_" + to_string(icount2id[icount])).c_str());
+        save_checkpoint(env, ckpt_save_path  + "/" + "w" + to_string(icount2weight[icount]) + "_" + to_string(icount2id[icount]));
         icount2weight.erase(icount);
         check_exit();
     }
@@ -80,12 +90,19 @@ extern "C" la_emu_plugin_ops* la_emu_plugin_install(const char* arg) {
                 begin_after_ibar0x40 = stol(sp[1]);
             } else if (sp[0] == "path") {
                 ckpt_save_path = sp[1];
+            } else if (sp[0] == "writers") {
+                ckpt_writers = stol(sp[1]);
             } else {
                 printf("unknown option:%s\n", option.c_str());
             }
         }
     }
 
+    if (ckpt_writers && !la_emu_checkpoint_can_fork()) {
+        fprintf(stderr, "writers=%d needs anonymous ram, not --memfd or hugetlb pages, checkpoints are saved in place\n", ckpt_writers);
+        ckpt_writers = 0;
+    }
+
     FILE* simpoints_file = fopen_nofail(simpoints_file_name.c_str(), "r");
     FILE* weights_file = fopen_nofail(weights_file_name.c_str(), "r");
 
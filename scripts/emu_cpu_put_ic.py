@@ -34,3 +34,63 @@ for line in lines:
         # line = line[0:r.span()[0]] + s + line[r.span()[1]:]
         # inst.add("LA_INST_" + r.group(1).upper())
     print(line, end="")
+
+# decode_ic: same decoder, but only records handler and args into ic without executing
+ops = []
+in_decode = False
+for line in lines:
+    if line.startswith("static bool decode(DisasContext *ctx, uint32_t insn)"):
+        in_decode = True
+        continue
+    if not in_decode:
+        continue
+    r = re.search("if \(trans_(.*)\(ctx, (.*)\)\)", line)
+    if r and r.group(1) not in ops:
+        ops.append(r.group(1))
+    if line == "}\n":
+        break
+
+print("")
+print("enum {")
+print("    LA_OP_INVALID,")
+for op in ops:
+    print("    LA_OP_%s," % op)
+print("};")
+
+in_decode = False
+for line in lines:
+    if line.startswith("static bool decode(DisasContext *ctx, uint32_t insn)"):
+        in_decode = True
+        print("")
+        print("static bool decode_ic(DisasContext *ctx, uint32_t insn, INSCache *ic)")
+        continue
+    if not in_decode:
+        continue
+    r = re.search("if \(trans_(.*)\(ctx, (.*)\)\)", line)
+    if r:
+        s = "if (cpu_set_ic(ic, (bool (*)(void*, void*))trans_%s, %s, insn, LA_OP_%s))" % (r.group(1), r.group(2), r.group(1))
+        line = line[0:r.span()[0]] + s + line[r.span()[1]:]
+    print(line, end="")
+    if line == "}\n":
+        break
+
+# exec_threaded: run a pre-decoded block, every handler jumps to the next one's handler
+print("")
+print("#if defined(CONFIG_THREADED)")
+print("static int exec_threaded(CPULoongArchState *env, INSCache *ic, int n, hwaddr pa)")
+print("{")
+print("    static const void *const dispatch[] = {")
+print("        [LA_OP_INVALID] = &&threaded_exit,")
+for op in ops:
+    print("        [LA_OP_%s] = &&do_%s," % (op, op))
+print("    };")
+print("    int i = 0;")
+print("    goto *dispatch[ic->op];")
+for op in ops:
+    print("do_%s:" % op)
+    print("    trans_%s(env, (void *)ic->arg);" % op)
+    print("    THREADED_NEXT();")
+print("threaded_exit:")
+print("    return i;")
+print("}")
+print("#endif")
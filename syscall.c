@@ -62,6 +62,115 @@ void target_set_brk(abi_ulong new_brk)
     qemu_log_mask(CPU_LOG_PAGE, "initial_target_brk:%lx\n", initial_target_brk);
 }
 
+void target_get_brk(abi_ulong *brk, abi_ulong *initial_brk)
+{
+    *brk = target_brk;
+    *initial_brk = initial_target_brk;
+}
+
+void target_restore_brk(abi_ulong brk, abi_ulong initial_brk)
+{
+    target_brk = brk;
+    initial_target_brk = initial_brk;
+}
+
+/* Sorted, adjacent regions alike are merged. */
+GuestRegion *guest_regions;
+int guest_region_num;
+static int guest_region_cap;
+unsigned long guest_fds[BITS_TO_LONGS(GUEST_FD_MAX)];
+
+static void guest_region_insert(int i, abi_ulong start, abi_ulong end, int prot, bool anon)
+{
+    if (guest_region_num == guest_region_cap) {
+        guest_region_cap = MAX(guest_region_cap * 2, 64);
+        guest_regions = realloc(guest_regions, guest_region_cap * sizeof(GuestRegion));
+        lsassert(guest_regions);
+    }
+    memmove(&guest_regions[i + 1], &guest_regions[i], (guest_region_num - i) * sizeof(GuestRegion));
+    guest_regions[i] = (GuestRegion){ start, end, prot, anon };
+    guest_region_num++;
+}
+
+static void guest_region_delete(int i)
+{
+    guest_region_num--;
+    memmove(&guest_regions[i], &guest_regions[i + 1], (guest_region_num - i) * sizeof(GuestRegion));
+}
+
+void guest_region_remove(abi_ulong start, abi_ulong len)
+{
+    abi_ulong end = start + TARGET_PAGE_ALIGN(len);
+    for (int i = 0; i < guest_region_num; i++) {
+        GuestRegion *r = &guest_regions[i];
+        if (r->end <= start || r->start >= end) {
+            continue;
+        }
+        if (r->start < start && r->end > end) {
+            guest_region_insert(i + 1, end, r->end, r->prot, r->anon);
+            guest_regions[i].end = start;
+            return;
+        }
+        if (r->start < start) {
+            r->end = start;
+        } else if (r->end > end) {
+            r->start = end;
+        } else {
+            guest_region_delete(i--);
+        }
+    }
+}
+
+void guest_region_add(abi_ulong start, abi_ulong len, int prot, bool anon)
+{
+    abi_ulong end = start + TARGET_PAGE_ALIGN(len);
+    int i = 0;
+
+    guest_region_remove(start, len);
+    while (i < guest_region_num && guest_regions[i].start < start) {
+        i++;
+    }
+    if (i > 0 && guest_regions[i - 1].end == start &&
+        guest_regions[i - 1].prot == prot && guest_regions[i - 1].anon == anon) {
+        guest_regions[i - 1].end = end;
+        if (i < guest_region_num && guest_regions[i].start == end &&
+            guest_regions[i].prot == prot && guest_regions[i].anon == anon) {
+            guest_regions[i - 1].end = guest_regions[i].end;
+            guest_region_delete(i);
+        }
+    } else if (i < guest_region_num && guest_regions[i].start == end &&
+               guest_regions[i].prot == prot && guest_regions[i].anon == anon) {
+        guest_regions[i].start = start;
+    } else {
+        guest_region_insert(i, start, end, prot, anon);
+    }
+}
+
+static int guest_region_prot(abi_ulong addr, bool *anon)
+{
+    for (int i = 0; i < guest_region_num; i++) {
+        if (guest_regions[i].start <= addr && addr < guest_regions[i].end) {
+            *anon = guest_regions[i].anon;
+            return guest_regions[i].prot;
+        }
+    }
+    *anon = true;
+    return PROT_READ | PROT_WRITE;
+}
+
+/*
+ * fds saved in user checkpoints. openat, pipe2 and fcntl F_DUPFD are the
+ * only syscalls here that create one, a syscall added later that does must
+ * call this too or its fd is missing after restore. stdin, stdout and
+ * stderr are the host's and never saved.
+ */
+static void guest_fd_add(abi_long fd)
+{
+    if (fd >= 0 && fd < GUEST_FD_MAX) {
+        set_bit(fd, guest_fds);
+    }
+}
+
 /* do_brk() must return target values and target errnos. */
 abi_long do_brk(abi_ulong brk_val)
 {
@@ -88,6 +197,7 @@ abi_long do_brk(abi_ulong brk_val)
     /* Release heap if necessary */
     if (new_brk < old_brk) {
         munmap((void*)new_brk, old_brk - new_brk);
+        guest_region_remove(new_brk, old_brk - new_brk);
 
         target_brk = brk_val;
         return target_brk;
@@ -102,6 +212,7 @@ abi_long do_brk(abi_ulong brk_val)
                               -1, 0);
 
     if (mapped_addr == old_brk) {
+        guest_region_add(old_brk, new_brk - old_brk, PROT_READ | PROT_WRITE, true);
         target_brk = brk_val;
         return target_brk;
     }
@@ -293,7 +404,11 @@ static inline int is_error(abi_long ret)
 static abi_long do_mmap(abi_ulong addr, abi_ulong len, int prot,
                         int target_flags, int fd, off_t offset)
 {
-    return get_errno((abi_long)mmap((void*)addr, len, prot, target_flags, fd, offset));
+    abi_long ret = get_errno((abi_long)mmap((void*)addr, len, prot, target_flags, fd, offset));
+    if (!is_error(ret)) {
+        guest_region_add(ret, len, prot, target_flags & MAP_ANONYMOUS);
+    }
+    return ret;
 }
 
 struct target_stat {
@@ -364,7 +479,11 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             }
             return ret;
         case TARGET_NR_fcntl:
-            return get_errno(fcntl(arg1, arg2, arg3));
+            ret = get_errno(fcntl(arg1, arg2, arg3));
+            if (arg2 == F_DUPFD || arg2 == F_DUPFD_CLOEXEC) {
+                guest_fd_add(ret);
+            }
+            return ret;
         case TARGET_NR_ioctl:
             return get_errno(ioctl(arg1, arg2, arg3));
         case TARGET_NR_faccessat:
@@ -374,9 +493,18 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         case TARGET_NR_ftruncate:
             return get_errno(ftruncate(arg1, arg2));
         case TARGET_NR_close:
-            return get_errno(close(arg1));
+            ret = get_errno(close(arg1));
+            if (!is_error(ret) && arg1 < GUEST_FD_MAX) {
+                clear_bit(arg1, guest_fds);
+            }
+            return ret;
         case TARGET_NR_pipe2:
-            return get_errno(pipe2((void*)arg1, arg2));
+            ret = get_errno(pipe2((void*)arg1, arg2));
+            if (!is_error(ret)) {
+                guest_fd_add(((int*)arg1)[0]);
+                guest_fd_add(((int*)arg1)[1]);
+            }
+            return ret;
         case TARGET_NR_getdents64:
             fprintf(stderr, "lxy: %s:%d %s warning TARGET_NR_getdents64\n", __FILE__,__LINE__,__func__);
             return get_errno(getdents64(arg1, (void*)arg2, arg3));
@@ -429,6 +557,7 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             return ret;
         case TARGET_NR_openat:
             ret = get_errno(openat(arg1, (char*)arg2, arg3, arg4));
+            guest_fd_add(ret);
             return ret;
         case TARGET_NR_exit:
         case TARGET_NR_exit_group:
@@ -483,9 +612,20 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         case TARGET_NR_brk:
             return do_brk(arg1);
         case TARGET_NR_munmap:
-            return get_errno(munmap((void*)arg1, arg2));
+            ret = get_errno(munmap((void*)arg1, arg2));
+            if (!is_error(ret)) {
+                guest_region_remove(arg1, arg2);
+            }
+            return ret;
         case TARGET_NR_mremap:
-            return get_errno((abi_long)mremap((void*)arg1, arg2, arg3, arg4, (void*)arg5));
+            ret = get_errno((abi_long)mremap((void*)arg1, arg2, arg3, arg4, (void*)arg5));
+            if (!is_error(ret)) {
+                bool anon;
+                int prot = guest_region_prot(arg1, &anon);
+                guest_region_remove(arg1, arg2);
+                guest_region_add(ret, arg3, prot, anon);
+            }
+            return ret;
         case TARGET_NR_mmap:
             return do_mmap(arg1, arg2, arg3, arg4, arg5, arg6);
         case TARGET_NR_prlimit64:
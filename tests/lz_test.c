@@ -0,0 +1,108 @@
+/*
+ * lz round trip: make test
+ * compresses into LZ_BOUND(n) bytes, which must always fit, decompresses and
+ * compares, then checks that short buffers and truncated input are refused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MB (1ul << 20)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static int failed;
+
+static uint64_t rand_state = 0x9e3779b97f4a7c15ul;
+
+static uint64_t rand64(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static void fill_random(uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        p[i] = rand64();
+    }
+}
+
+// runs of random words, repeats and zeros, like a guest ram page
+static void fill_mixed(uint8_t* p, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t len = MIN(rand64() % 300 + 1, n - i);
+        switch (rand64() % 3) {
+        case 0:
+            fill_random(p + i, len);
+            break;
+        case 1:
+            memset(p + i, 0, len);
+            break;
+        default:
+            for (size_t j = 0; j < len; j++) {
+                p[i + j] = i >= 64 ? p[i + j - 64] : j;
+            }
+            break;
+        }
+        i += len;
+    }
+}
+
+static void check(const char* name, const uint8_t* src, size_t n) {
+    size_t cap = LZ_BOUND(n);
+    uint8_t* buf = malloc(cap);
+    uint8_t* out = malloc(n + 1);
+    int64_t size = lz_compress(src, n, buf, cap);
+    if (size < 0) {
+        fprintf(stderr, "%s %zu: does not fit in LZ_BOUND\n", name, n);
+        failed++;
+        goto out;
+    }
+    if (lz_decompress(buf, size, out, n) != n || memcmp(src, out, n)) {
+        fprintf(stderr, "%s %zu: round trip differs\n", name, n);
+        failed++;
+        goto out;
+    }
+    if (n && lz_decompress(buf, size, out, n - 1) != -1) {
+        fprintf(stderr, "%s %zu: decompressed into a short buffer\n", name, n);
+        failed++;
+    }
+    if (size > 1 && lz_decompress(buf, size - 1, out, n) == n && !memcmp(src, out, n)) {
+        fprintf(stderr, "%s %zu: truncated input decompressed\n", name, n);
+        failed++;
+    }
+    if (n && lz_compress(src, n, buf, size - 1) != -1) {
+        fprintf(stderr, "%s %zu: compressed into a short buffer\n", name, n);
+        failed++;
+    }
+    printf("%-8s %8zu -> %8ld\n", name, n, size);
+out:
+    free(buf);
+    free(out);
+}
+
+int main(void) {
+    // sizes around the 1MB checkpoint chunk and below the minimum match input
+    size_t sizes[] = {0, 1, 4, 12, 13, 17, 255, 4096, MB - 1, MB, MB + 1, 2 * MB};
+    uint8_t* src = malloc(2 * MB);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t n = sizes[i];
+        fill_random(src, n);
+        check("random", src, n);
+        memset(src, 0, n);
+        check("zero", src, n);
+        fill_mixed(src, n);
+        check("mixed", src, n);
+    }
+    // a match that runs up to the last byte of a chunk
+    memset(src, 0xa5, MB);
+    fill_random(src, 64);
+    memcpy(src + MB - 64, src, 64);
+    check("tail", src, MB);
+    free(src);
+    printf(failed ? "lz test FAILED\n" : "lz test passed\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
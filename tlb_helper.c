@@ -17,7 +17,8 @@
 // #include "exec/log.h"
 // #include "cpu-csr.h"
 
-#define tlb_flush(...) ;
+// the soft tlb (tc) is the only cached copy of tlb entries
+#define tlb_flush(...) cpu_clear_tc(env)
 
 void get_dir_base_width(CPULoongArchState *env, uint64_t *dir_base,
                                uint64_t *dir_width, target_ulong level)
@@ -118,19 +119,23 @@ static void raise_mmu_exception(CPULoongArchState *env, target_ulong address,
     // data consistency between the tlb and the page table in memory.
     if (enable_hw_ptw(env) && cs->exception_index >= EXCCODE_PIL && cs->exception_index <= EXCCODE_PPI) {
         helper_invtlb_page_asid_or_g(env, env->CSR_ASID, address);
+        loongarch_pwc_flush_page(env, address);
     }
 
 }
 
-#define invalidate_tlb(...) ;
-#if 0
-static void invalidate_tlb_entry(CPULoongArchState *env, int index)
+// drop the tc entries translated by tlb[index], tc keeps every asid so the
+// entry is invalidated whatever the current asid is
+static void invalidate_tlb(CPULoongArchState *env, int index)
 {
     target_ulong addr, mask, pagesize;
     uint8_t tlb_ps;
     LoongArchTLB *tlb = &env->tlb[index];
 
-    int mmu_idx = cpu_mmu_index(env_cpu(env), false);
+    if (!FIELD_EX64(tlb->tlb_misc, TLB_MISC, E)) {
+        return;
+    }
+
     uint8_t tlb_v0 = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, V);
     uint8_t tlb_v1 = FIELD_EX64(tlb->tlb_entry1, TLBENTRY, V);
     uint64_t tlb_vppn = FIELD_EX64(tlb->tlb_misc, TLB_MISC, VPPN);
@@ -142,35 +147,137 @@ static void invalidate_tlb_entry(CPULoongArchState *env, int index)
     }
     pagesize = MAKE_64BIT_MASK(tlb_ps, 1);
     mask = MAKE_64BIT_MASK(0, tlb_ps + 1);
+    addr = (tlb_vppn << R_TLB_MISC_VPPN_SHIFT) & ~mask;
 
-    if (tlb_v0) {
-        addr = (tlb_vppn << R_TLB_MISC_VPPN_SHIFT) & ~mask;    /* even */
-        tlb_flush_range_by_mmuidx(env_cpu(env), addr, pagesize,
-                                  mmu_idx, TARGET_LONG_BITS);
+    if (tlb_v0 && tlb_v1) {
+        cpu_tc_flush_range(env, addr, pagesize * 2);
+    } else if (tlb_v0) {
+        cpu_tc_flush_range(env, addr, pagesize);    /* even */
+    } else if (tlb_v1) {
+        cpu_tc_flush_range(env, addr + pagesize, pagesize);    /* odd */
     }
+}
 
-    if (tlb_v1) {
-        addr = (tlb_vppn << R_TLB_MISC_VPPN_SHIFT) & pagesize;    /* odd */
-        tlb_flush_range_by_mmuidx(env_cpu(env), addr, pagesize,
-                                  mmu_idx, TARGET_LONG_BITS);
+static int16_t *tlb_index_list(CPULoongArchState *env, int index)
+{
+    LoongArchTLB *tlb = &env->tlb[index];
+
+    if (FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G)) {
+        return &env->tlb_index.g_head;
     }
+    return &env->tlb_index.asid_head[FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID)];
 }
 
-static void invalidate_tlb(CPULoongArchState *env, int index)
+static int8_t *tlb_index_mtlb_bucket(CPULoongArchState *env, int index)
 {
-    LoongArchTLB *tlb;
-    uint16_t csr_asid, tlb_asid, tlb_g;
+    LoongArchTLB *tlb = &env->tlb[index];
+    uint8_t tlb_ps = FIELD_EX64(tlb->tlb_misc, TLB_MISC, PS);
+    uint64_t tlb_vppn = FIELD_EX64(tlb->tlb_misc, TLB_MISC, VPPN);
+    uint64_t vpn = tlb_vppn >> (tlb_ps + 1 - R_TLB_MISC_VPPN_SHIFT);
 
-    csr_asid = FIELD_EX64(env->CSR_ASID, CSR_ASID, ASID);
-    tlb = &env->tlb[index];
-    tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
-    tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
-    if (tlb_g == 0 && tlb_asid != csr_asid) {
-        return;
+    return &env->tlb_index.mtlb_head[loongarch_mtlb_hash(vpn, tlb_ps)];
+}
+
+/* STLBPS tlb[index] is filled under, STLB_STRAY if lookups never reach it */
+static uint8_t tlb_index_stlb_ps(CPULoongArchState *env, int index)
+{
+    uint8_t stlb_ps = FIELD_EX64(env->CSR_STLBPS, CSR_STLBPS, PS);
+    uint64_t tlb_vppn = FIELD_EX64(env->tlb[index].tlb_misc, TLB_MISC, VPPN);
+    int set = ((tlb_vppn << R_TLB_MISC_VPPN_SHIFT) >> (stlb_ps + 1)) & 0xff;
+
+    return set == index % 256 ? stlb_ps : STLB_STRAY;
+}
+
+void loongarch_tlb_index_reset(CPULoongArchState *env)
+{
+    LoongArchTLBIndex *ti = &env->tlb_index;
+
+    memset(ti, 0, sizeof(*ti));
+    memset(ti->asid_head, -1, sizeof(ti->asid_head));
+    memset(ti->mtlb_head, -1, sizeof(ti->mtlb_head));
+    ti->g_head = -1;
+}
+
+/* tlb[index] just became valid */
+static void tlb_index_insert(CPULoongArchState *env, int index)
+{
+    LoongArchTLBIndex *ti = &env->tlb_index;
+    int16_t *head = tlb_index_list(env, index);
+
+    ti->prev[index] = -1;
+    ti->next[index] = *head;
+    if (*head >= 0) {
+        ti->prev[*head] = index;
+    }
+    *head = index;
+
+    if (index >= LOONGARCH_STLB) {
+        int8_t *bucket = tlb_index_mtlb_bucket(env, index);
+        uint8_t tlb_ps = FIELD_EX64(env->tlb[index].tlb_misc, TLB_MISC, PS);
+
+        ti->mtlb_next[index - LOONGARCH_STLB] = *bucket;
+        *bucket = index - LOONGARCH_STLB;
+        if (ti->mtlb_ps_count[tlb_ps]++ == 0) {
+            ti->mtlb_ps_mask |= 1ULL << tlb_ps;
+        }
+    } else {
+        uint8_t stlb_ps = tlb_index_stlb_ps(env, index);
+
+        ti->stlb_ps[index] = stlb_ps;
+        if (stlb_ps == STLB_STRAY) {
+            ti->stlb_stray++;
+        } else if (ti->stlb_ps_count[stlb_ps]++ == 0) {
+            ti->stlb_ps_mask |= 1ULL << stlb_ps;
+        }
+    }
+}
+
+/* tlb[index] is valid and about to change */
+static void tlb_index_remove(CPULoongArchState *env, int index)
+{
+    LoongArchTLBIndex *ti = &env->tlb_index;
+    int16_t prev = ti->prev[index], next = ti->next[index];
+
+    if (prev >= 0) {
+        ti->next[prev] = next;
+    } else {
+        *tlb_index_list(env, index) = next;
+    }
+    if (next >= 0) {
+        ti->prev[next] = prev;
+    }
+
+    if (index >= LOONGARCH_STLB) {
+        int8_t *m = tlb_index_mtlb_bucket(env, index);
+        uint8_t tlb_ps = FIELD_EX64(env->tlb[index].tlb_misc, TLB_MISC, PS);
+
+        while (*m != index - LOONGARCH_STLB) {
+            m = &ti->mtlb_next[*m];
+        }
+        *m = ti->mtlb_next[index - LOONGARCH_STLB];
+        if (--ti->mtlb_ps_count[tlb_ps] == 0) {
+            ti->mtlb_ps_mask &= ~(1ULL << tlb_ps);
+        }
+    } else {
+        uint8_t stlb_ps = ti->stlb_ps[index];
+
+        if (stlb_ps == STLB_STRAY) {
+            ti->stlb_stray--;
+        } else if (--ti->stlb_ps_count[stlb_ps] == 0) {
+            ti->stlb_ps_mask &= ~(1ULL << stlb_ps);
+        }
+    }
+}
+
+static void tlb_clear_e(CPULoongArchState *env, int index)
+{
+    LoongArchTLB *tlb = &env->tlb[index];
+
+    if (FIELD_EX64(tlb->tlb_misc, TLB_MISC, E)) {
+        tlb_index_remove(env, index);
+        tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
     }
-    invalidate_tlb_entry(env, index);
 }
-#endif
 
 static void fill_tlb_entry(CPULoongArchState *env, int index)
 {
@@ -204,6 +311,10 @@ static void fill_tlb_entry(CPULoongArchState *env, int index)
         qemu_log_mask(CPU_LOG_MMU, "page size is 0\n");
     }
 
+    if (FIELD_EX64(tlb->tlb_misc, TLB_MISC, E)) {
+        tlb_index_remove(env, index);
+    }
+
     /* Only MTLB has the ps fields */
     if (index >= LOONGARCH_STLB) {
         tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, PS, csr_ps);
@@ -221,6 +332,7 @@ static void fill_tlb_entry(CPULoongArchState *env, int index)
 
     tlb->tlb_entry0 = lo0;
     tlb->tlb_entry1 = lo1;
+    tlb_index_insert(env, index);
 }
 
 /* Return an random value between low and high */
@@ -259,6 +371,13 @@ void helper_tlbrd(CPULoongArchState *env)
     uint8_t tlb_ps, tlb_e;
 
     index = FIELD_EX64(env->CSR_TLBIDX, CSR_TLBIDX, INDEX);
+    if (index >= LOONGARCH_TLB_MAX) {
+        /* no such entry, reads as invalid */
+        index = 0;
+        tlb_e = 0;
+    } else {
+        tlb_e = FIELD_EX64(env->tlb[index].tlb_misc, TLB_MISC, E);
+    }
     tlb = &env->tlb[index];
 
     if (index >= LOONGARCH_STLB) {
@@ -266,7 +385,6 @@ void helper_tlbrd(CPULoongArchState *env)
     } else {
         tlb_ps = FIELD_EX64(env->CSR_STLBPS, CSR_STLBPS, PS);
     }
-    tlb_e = FIELD_EX64(tlb->tlb_misc, TLB_MISC, E);
 
     if (!tlb_e) {
         /* Invalid TLB entry */
@@ -292,11 +410,15 @@ void helper_tlbwr(CPULoongArchState *env)
 {
     int index = FIELD_EX64(env->CSR_TLBIDX, CSR_TLBIDX, INDEX);
 
+    /* a stale bit 11 past the 11-bit csrwr mask, no such entry */
+    if (index >= LOONGARCH_TLB_MAX) {
+        return;
+    }
+
     invalidate_tlb(env, index);
 
     if (FIELD_EX64(env->CSR_TLBIDX, CSR_TLBIDX, NE)) {
-        env->tlb[index].tlb_misc = FIELD_DP64(env->tlb[index].tlb_misc,
-                                              TLB_MISC, E, 0);
+        tlb_clear_e(env, index);
         return;
     }
 
@@ -355,7 +477,7 @@ void helper_tlbclr(CPULoongArchState *env)
             tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
             tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
             if (!tlb_g && tlb_asid == csr_asid) {
-                tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
+                tlb_clear_e(env, i * 256 + (index % 256));
             }
         }
     } else if (index < LOONGARCH_TLB_MAX) {
@@ -365,7 +487,7 @@ void helper_tlbclr(CPULoongArchState *env)
             tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
             tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
             if (!tlb_g && tlb_asid == csr_asid) {
-                tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
+                tlb_clear_e(env, i);
             }
         }
     }
@@ -382,15 +504,12 @@ void helper_tlbflush(CPULoongArchState *env)
     if (index < LOONGARCH_STLB) {
         /* STLB. One line per operation */
         for (i = 0; i < 8; i++) {
-            int s_idx = i * 256 + (index % 256);
-            env->tlb[s_idx].tlb_misc = FIELD_DP64(env->tlb[s_idx].tlb_misc,
-                                                  TLB_MISC, E, 0);
+            tlb_clear_e(env, i * 256 + (index % 256));
         }
     } else if (index < LOONGARCH_TLB_MAX) {
         /* All MTLB entries */
         for (i = LOONGARCH_STLB; i < LOONGARCH_TLB_MAX; i++) {
-            env->tlb[i].tlb_misc = FIELD_DP64(env->tlb[i].tlb_misc,
-                                              TLB_MISC, E, 0);
+            tlb_clear_e(env, i);
         }
     }
 
@@ -403,17 +522,23 @@ void helper_invtlb_all(CPULoongArchState *env)
         env->tlb[i].tlb_misc = FIELD_DP64(env->tlb[i].tlb_misc,
                                           TLB_MISC, E, 0);
     }
+    loongarch_tlb_index_reset(env);
     tlb_flush(env_cpu(env));
 }
 
 void helper_invtlb_all_g(CPULoongArchState *env, uint32_t g)
 {
-    for (int i = 0; i < LOONGARCH_TLB_MAX; i++) {
-        LoongArchTLB *tlb = &env->tlb[i];
-        uint8_t tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
+    LoongArchTLBIndex *ti = &env->tlb_index;
 
-        if (tlb_g == g) {
-            tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
+    if (g) {
+        while (ti->g_head >= 0) {
+            tlb_clear_e(env, ti->g_head);
+        }
+    } else {
+        for (int asid = 0; asid <= R_CSR_ASID_ASID_MASK; asid++) {
+            while (ti->asid_head[asid] >= 0) {
+                tlb_clear_e(env, ti->asid_head[asid]);
+            }
         }
     }
     tlb_flush(env_cpu(env));
@@ -422,25 +547,77 @@ void helper_invtlb_all_g(CPULoongArchState *env, uint32_t g)
 void helper_invtlb_all_asid(CPULoongArchState *env, target_ulong info)
 {
     uint16_t asid = info & R_CSR_ASID_ASID_MASK;
+    LoongArchTLBIndex *ti = &env->tlb_index;
 
-    for (int i = 0; i < LOONGARCH_TLB_MAX; i++) {
-        LoongArchTLB *tlb = &env->tlb[i];
-        uint8_t tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
-        uint16_t tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
+    while (ti->asid_head[asid] >= 0) {
+        tlb_clear_e(env, ti->asid_head[asid]);
+    }
+    cpu_tc_flush_asid(env, asid);
+}
 
-        if (!tlb_g && (tlb_asid == asid)) {
-            tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
+/*
+ * The valid entries that may map addr, compared with the current STLBPS as
+ * a scan of all entries does: the ways of the STLB sets addr indexed under
+ * each STLBPS entries were filled under, every set while there are strays,
+ * and the MTLB hash chains of the page sizes in use.
+ */
+static int tlb_page_candidates(CPULoongArchState *env, target_ulong addr,
+                               int *index)
+{
+    LoongArchTLBIndex *ti = &env->tlb_index;
+    uint8_t stlb_ps = FIELD_EX64(env->CSR_STLBPS, CSR_STLBPS, PS);
+    uint64_t sets[256 / 64] = {0};
+    int n = 0;
+
+    if (ti->stlb_stray) {
+        memset(sets, 0xff, sizeof(sets));
+    }
+    for (uint64_t ps_mask = ti->stlb_ps_mask; ps_mask; ps_mask &= ps_mask - 1) {
+        int ps = ctz64(ps_mask);
+        /* set bits below the current page size are not compared */
+        int loose = MIN(MAX(stlb_ps - ps, 0), 8);
+        int set = ((addr & TARGET_VIRT_MASK) >> (ps + 1)) & 0xff & ~((1 << loose) - 1);
+
+        for (int s = set; s < set + (1 << loose); s++) {
+            sets[s / 64] |= 1ULL << (s % 64);
         }
     }
-    tlb_flush(env_cpu(env));
+    for (int w = 0; w < 256 / 64; w++) {
+        for (uint64_t m = sets[w]; m; m &= m - 1) {
+            int s = w * 64 + ctz64(m);
+            for (int i = 0; i < 8; i++) {
+                if (FIELD_EX64(env->tlb[i * 256 + s].tlb_misc, TLB_MISC, E)) {
+                    index[n++] = i * 256 + s;
+                }
+            }
+        }
+    }
+    uint64_t buckets = 0;
+    for (uint64_t ps_mask = ti->mtlb_ps_mask; ps_mask; ps_mask &= ps_mask - 1) {
+        int ps = ctz64(ps_mask);
+        uint64_t vpn = (addr & TARGET_VIRT_MASK) >> (ps + 1);
+        int h = loongarch_mtlb_hash(vpn, ps);
+        /* page sizes may share a bucket, walk its chain once */
+        if (buckets & (1ULL << h)) {
+            continue;
+        }
+        buckets |= 1ULL << h;
+        for (int m = ti->mtlb_head[h]; m >= 0; m = ti->mtlb_next[m]) {
+            index[n++] = LOONGARCH_STLB + m;
+        }
+    }
+    return n;
 }
 
 void helper_invtlb_page_asid(CPULoongArchState *env, target_ulong info,
                              target_ulong addr)
 {
     uint16_t asid = info & 0x3ff;
+    int index[LOONGARCH_TLB_MAX];
+    int n = tlb_page_candidates(env, addr, index);
 
-    for (int i = 0; i < LOONGARCH_TLB_MAX; i++) {
+    for (int k = 0; k < n; k++) {
+        int i = index[k];
         LoongArchTLB *tlb = &env->tlb[i];
         uint8_t tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
         uint16_t tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
@@ -458,18 +635,21 @@ void helper_invtlb_page_asid(CPULoongArchState *env, target_ulong info,
 
         if (!tlb_g && (tlb_asid == asid) &&
            (vpn == (tlb_vppn >> compare_shift))) {
-            tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
+            invalidate_tlb(env, i);
+            tlb_clear_e(env, i);
         }
     }
-    tlb_flush(env_cpu(env));
 }
 
 void helper_invtlb_page_asid_or_g(CPULoongArchState *env,
                                   target_ulong info, target_ulong addr)
 {
     uint16_t asid = info & 0x3ff;
+    int index[LOONGARCH_TLB_MAX];
+    int n = tlb_page_candidates(env, addr, index);
 
-    for (int i = 0; i < LOONGARCH_TLB_MAX; i++) {
+    for (int k = 0; k < n; k++) {
+        int i = index[k];
         LoongArchTLB *tlb = &env->tlb[i];
         uint8_t tlb_g = FIELD_EX64(tlb->tlb_entry0, TLBENTRY, G);
         uint16_t tlb_asid = FIELD_EX64(tlb->tlb_misc, TLB_MISC, ASID);
@@ -487,10 +667,10 @@ void helper_invtlb_page_asid_or_g(CPULoongArchState *env,
 
         if ((tlb_g || (tlb_asid == asid)) &&
             (vpn == (tlb_vppn >> compare_shift))) {
-            tlb->tlb_misc = FIELD_DP64(tlb->tlb_misc, TLB_MISC, E, 0);
+            invalidate_tlb(env, i);
+            tlb_clear_e(env, i);
         }
     }
-    tlb_flush(env_cpu(env));
 }
 
 #if 0
@@ -717,6 +897,8 @@ void helper_ertn(CPULoongArchState *env)
     }
     env->CSR_CRMD = FIELD_DP64(env->CSR_CRMD, CSR_CRMD, PLV, csr_pplv);
     env->CSR_CRMD = FIELD_DP64(env->CSR_CRMD, CSR_CRMD, IE, csr_pie);
+    cpu_dmw_refresh(env);
+    env->irq_pending = true;
 
     if (FIELD_EX64(env->CSR_LLBCTL, CSR_LLBCTL, KLO) != 1) {
         env->CSR_LLBCTL = FIELD_DP64(env->CSR_LLBCTL, CSR_LLBCTL, ROLLB, 0);
@@ -50,8 +50,27 @@ struct image_info {
 #define TARGET_PAGE_ALIGN(addr) ROUND_UP((addr), TARGET_PAGE_SIZE)
 
 void target_set_brk(abi_ulong new_brk);
+void target_get_brk(abi_ulong *brk, abi_ulong *initial_brk);
+void target_restore_brk(abi_ulong brk, abi_ulong initial_brk);
 extern char *exec_path;
 
+/* Guest memory regions and files, what a user mode checkpoint saves. */
+typedef struct GuestRegion {
+    abi_ulong start;
+    abi_ulong end;
+    int prot;
+    bool anon;
+} GuestRegion;
+
+extern GuestRegion *guest_regions;
+extern int guest_region_num;
+void guest_region_add(abi_ulong start, abi_ulong len, int prot, bool anon);
+void guest_region_remove(abi_ulong start, abi_ulong len);
+void reserve_user_regions(const char* image_dir);
+
+#define GUEST_FD_MAX 1024
+extern unsigned long guest_fds[];
+
 abi_long do_syscall(CPUArchState *cpu_env, int num, abi_long arg1,
                     abi_long arg2, abi_long arg3, abi_long arg4,
                     abi_long arg5, abi_long arg6, abi_long arg7,